@@ -24,6 +24,7 @@
 #include <string.h>
 #include <termios.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <sys/queue.h>
 
@@ -31,14 +32,6 @@
 
 #include "glucosemeter.h"
 
-#define DEBUG
-
-#ifdef DEBUG
-#define DPRINTF(x) do { printf x; } while(0)
-#else
-#define DPRINTF(x)
-#endif
-
 static void abfr_line_dev(struct abfr_dev *dev, char *line);
 static void abfr_line_soft(struct abfr_dev *dev, char *line);
 static void abfr_line_date(struct abfr_dev *dev, char *line);
@@ -47,18 +40,16 @@ static void abfr_line_result(struct abfr_dev *dev, char *line);
 static void abfr_line_end(struct abfr_dev *dev, char *line);
 static void abfr_line_empty(struct abfr_dev *dev, char *line);
 static void abfr_parseline(struct abfr_dev *dev, char *line);
+static void abfr_parse_failed(struct abfr_dev *dev);
+static void abfr_release(struct abfr_dev *dev);
 
-static int			abfr_parsetime(char *p, struct tm *r);
 static enum abfr_devtype	abfr_parsedev(char *type);
 static enum abfr_softrev	abfr_parsesoft(char *rev);
 static int			abfr_nentries(char *);
-static int			abfr_parse_entry(char *p, struct abfr_entry *entry);
-static uint16_t			abfr_calc_checksum(char *line);
 static int			abfr_parse_checksum(char *line, uint16_t *checksum);
 
 static int dev_cmp(const void *k, const void *e);
 static int rev_cmp(const void *k, const void *e);
-static int month_cmp(const void *k, const void *e);
 
 static gboolean abfr_in(struct device *dev, GIOChannel *gio);
 static gboolean abfr_out(struct device *dev, GIOChannel *gio);
@@ -66,6 +57,8 @@ static gboolean abfr_error(struct device *dev, GIOChannel *gio);
 
 int abfr_start(struct device *);
 int abfr_stop(struct device *);
+static struct device *abfr_new(const char *);
+static void abfr_free(struct device *);
 
 struct driver abfr_driver = {
 	"abfr",
@@ -74,6 +67,24 @@ struct driver abfr_driver = {
 	abfr_in,
 	abfr_out,
 	abfr_error,
+	abfr_new,
+	abfr_free,
+};
+
+/*
+ * How long the meter may take to send its next line, see
+ * devicemgmt_deadline(). It takes a while to start answering "mem", after
+ * that the lines follow each other closely.
+ */
+static const int abfr_timeouts[] = {
+	[ABFR_SEND_MEM]			= ABFR_TIMEOUT_ANSWER,
+	[ABFR_DEVICE_TYPE]		= ABFR_TIMEOUT_ANSWER,
+	[ABFR_SOFTWARE_REVISION]	= ABFR_TIMEOUT_LINE,
+	[ABFR_CURRENTDATETIME]		= ABFR_TIMEOUT_LINE,
+	[ABFR_NUMBEROFRESULTS]		= ABFR_TIMEOUT_LINE,
+	[ABFR_RESULTLINE]		= ABFR_TIMEOUT_LINE,
+	[ABFR_END]			= ABFR_TIMEOUT_LINE,
+	[ABFR_EMPTY]			= ABFR_TIMEOUT_LINE,
 };
 
 struct devlist {
@@ -86,13 +97,8 @@ struct softlist {
 	enum abfr_softrev	 softwaretype;
 };
 
-struct monthlist {
-	char	*month;
-	int 	 number;
-};
-
 struct abfr_dev *
-abfr_init(char *device_file)
+abfr_init(const char *device_file)
 {
 	struct abfr_dev *dev;
 
@@ -101,9 +107,61 @@ abfr_init(char *device_file)
 		return NULL;
 	}
 
+	if (device_file != NULL && (dev->file = strdup(device_file)) == NULL) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->device.driver = &abfr_driver;
+	dev->device.name = dev->file;
+
 	return dev;
 }
 
+static struct device *
+abfr_new(const char *device_file)
+{
+	struct abfr_dev *dev;
+
+	if ((dev = abfr_init(device_file)) == NULL)
+		return NULL;
+
+	return &dev->device;
+}
+
+/* The device is done and unlinked, see devicemgmt_remove() */
+static void
+abfr_free(struct device *dev)
+{
+	struct abfr_dev *abfr_dev = (struct abfr_dev *)dev;
+
+	abfr_release(abfr_dev);
+	free(abfr_dev->file);
+	free(abfr_dev);
+}
+
+/*
+ * Drop the results of a download which didn't complete, including what was
+ * already staged. After a verified download the writer owns them and there
+ * is nothing left to do.
+ */
+static void
+abfr_release(struct abfr_dev *dev)
+{
+	if (dev->batch != NULL) {
+		meas_batch_free(dev->batch);
+		dev->batch = NULL;
+	}
+
+	if (dev->download != 0) {
+		meas_stage_discard(dev->device.conf, dev->file, dev->download);
+		dev->download = 0;
+	}
+
+	g_free(dev->meter);
+	dev->meter = NULL;
+}
+
 static int
 abfr_open(char *dev)
 {
@@ -143,49 +201,40 @@ abfr_start(struct device *dev)
 {
 	struct abfr_dev		*abfr_dev = (struct abfr_dev *)dev;
 	int			 fd;
-	guint		 	 r;
 
 	fd = abfr_open(abfr_dev->file);
 	if (fd < 0) {
-		goto fail;
-	}
-
-	dev->channel = g_io_channel_unix_new(fd);
-	if (dev->channel == NULL) {
-		g_error("Cannnot create GIOChannel");
-
-		goto fail;
+		return (-1);
 	}
 
-	r = g_io_add_watch(dev->channel, G_IO_IN | G_IO_HUP, devicemgmt_input, dev);
-	if (!r) {
-		g_error("Cannnot watch GIOChannel");
+	/* Started again after a timeout, anything read before is gone */
+	abfr_dev->checksum = 0;
+	abfr_dev->nresults = 0;
+	abfr_dev->results_processed = 0;
+	abfr_dev->mark = 0;
+	abfr_dev->skipping = 0;
+	abfr_dev->inlen = 0;
 
-		goto fail;	
-	}
+	/* The meter answers "mem" with everything it has */
+	abfr_dev->protocol_state = ABFR_DEVICE_TYPE;
 
-	r = g_io_add_watch(dev->channel, G_IO_OUT | G_IO_HUP, devicemgmt_output, dev);
-	if (!r) {
-		g_error("Cannnot watch GIOChannel");
-		goto fail;
+	if (devicemgmt_open(dev, fd) == -1) {
+		g_warning("Cannot create GIOChannel");
+		return (-1);
 	}
 
-	r = g_io_add_watch(dev->channel, G_IO_ERR | G_IO_HUP, devicemgmt_error, dev);
-	if (!r) {
-		g_error("Cannnot watch GIOChannel");
-		goto fail;
-	}
+	devicemgmt_write(dev, "mem", 3);
+	devicemgmt_deadline(dev, abfr_timeouts[ABFR_DEVICE_TYPE]);
 
 	return 1;
-fail:
-	/* XXX: cleanup fd/channels */
-	return (-1);
 }
 
+/* Called once the device is done, see devicemgmt_done() */
 int
 abfr_stop(struct device *dev)
 {
-	/* XXX: close fd/channels */
+	abfr_release((struct abfr_dev *)dev);
+	devicemgmt_close(dev);
 
 	return 1;
 }
@@ -246,12 +295,6 @@ abfr_parsesoft(char *rev)
 	return ABFR_SOFT_UNKNOWN;
 }
 
-static int
-month_cmp(const void *k, const void *e)
-{
-        return (strcmp(k, ((const struct monthlist *)e)->month));
-}
-
 static int
 abfr_nentries(char *p)
 {
@@ -259,214 +302,13 @@ abfr_nentries(char *p)
 	const char	*errstr;
 
 	errstr = NULL;
-	/* XXX: change upper boundary to some kind of constant */
-	r = strtonum(p, 1, 450, &errstr);
+	r = strtonum(p, 1, ABFR_MAX_ENTRIES, &errstr);
 	if (errstr)
 		return (-1);
 
 	return (r);
 }
 
-// 234  Jan  17 2010 00:39 00 0x00
-static int
-abfr_parse_entry(char *p, struct abfr_entry *entry)
-{
-	char			*p2;
-	const char		*errstr;
-	struct monthlist	*m;
-	int			 yearint;
-
-	/* Keep sorted */
-	struct monthlist mlist[] = {
-		{ "Apr", 3 },
-		{ "Aug", 7 },
-		{ "Dec", 11 },
-		{ "Feb", 1 },
-		{ "Jan", 0 },
-		{ "July", 6 },
-		{ "June", 5 },
-		{ "Mar", 2 },
-		{ "May", 4 },
-		{ "Nov", 10 },
-		{ "Oct", 9 },
-		{ "Sep", 8 },
-	};
-
-	p2 = p;
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL; /* XXX: only necessary one time */
-	entry->bloodglucose = strtonum(p, 0, 400, &errstr); /* XXX: change 400 to sth decent */
-	if (errstr)
-		goto fail;
-
-	/* Skip leading space */
-	if (*p2 == ' ')
-		p2++;
-
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	m = bsearch(p, mlist, sizeof(mlist)/sizeof(mlist[0]),
-		sizeof(mlist[0]), month_cmp);
-
-	if (!m)
-		goto fail;
-
-	entry->ptm.tm_mon = m->number;
-
-	/* Skip leading space */
-	if (*p2 == ' ')
-		p2++;
-
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL;
-	entry->ptm.tm_mday = strtonum(p, 1, 31, &errstr);
-	if (errstr)
-		goto fail;
-
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL;
-	yearint = strtonum(p, 0, 9999, &errstr);
-	if (errstr)
-		goto fail;
-	entry->ptm.tm_year = yearint - 1900;
-
-	p = strsep(&p2, ":");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL; /* XXX: only necessary one time */
-	entry->ptm.tm_hour = strtonum(p, 0, 23, &errstr);
-	if (errstr)
-		goto fail;
-
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL; /* XXX: only necessary one time */
-	entry->ptm.tm_min = strtonum(p, 0, 59, &errstr);
-	if (errstr)
-		goto fail;
-
-
-	return (0);
-fail:
-	return (-1);
-}
-
-/* Jan  21 2010 20:40:00 */
-static int
-abfr_parsetime(char *p, struct tm *r)
-{
-	int	yearint;
-	struct monthlist *m;
-	const char	*errstr;
-	char *p2;
-
-	/* Keep sorted */
-	struct monthlist mlist[] = {
-		{ "Apr", 3 },
-		{ "Aug", 7 },
-		{ "Dec", 11 },
-		{ "Feb", 1 },
-		{ "Jan", 0 },
-		{ "July", 6 },
-		{ "June", 5 },
-		{ "Mar", 2 },
-		{ "May", 4 },
-		{ "Nov", 10 },
-		{ "Oct", 9 },
-		{ "Sep", 8 },
-	};
-
-	p2 = p;
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	m = bsearch(p, mlist, sizeof(mlist)/sizeof(mlist[0]),
-		sizeof(mlist[0]), month_cmp);
-
-	if (!m)
-		goto fail;
-
-	r->tm_mon = m->number;
-
-	/* Skip leading space */
-	if (*p2 == ' ')
-		p2++;
-
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL;
-	r->tm_mday = strtonum(p, 1, 31, &errstr);
-	if (errstr)
-		goto fail;
-
-	p = strsep(&p2, " ");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL;
-	yearint = strtonum(p, 0, 9999, &errstr); /* XXX: 3000 should be correspond to what can be stored in tm_year (minus 1900) */
-	if (errstr)
-		goto fail;
-
-	p = strsep(&p2, ":");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL; /* XXX: only necessary one time */
-	r->tm_hour = strtonum(p, 0, 23, &errstr);
-	if (errstr)
-		goto fail;
-
-	p = strsep(&p2, ":");
-	if (p2 == NULL)
-		goto fail;
-
-	errstr = NULL; /* XXX: only necessary one time */
-	r->tm_min = strtonum(p, 0, 59, &errstr);
-	if (errstr)
-		goto fail;
-
-	errstr = NULL; /* XXX: only necessary one time */
-	r->tm_sec = strtonum(p2, 0, 59, &errstr);
-	if (errstr)
-		goto fail;
-
-	return (0);
-
-fail:
-	printf("fail!\n");
-	return (-1);
-}
-
-static uint16_t
-abfr_calc_checksum(char *line)
-{
-	int i;
-	uint16_t checksum = 0;
-
-	for (i = 0; line[i] != '\0'; i++)
-		checksum += line[i];
-
-	return checksum;
-}
-
 static int
 abfr_parse_checksum(char *line, uint16_t *checksum)
 {
@@ -527,7 +369,16 @@ abfr_parseline(struct abfr_dev *dev, char *line)
 			break;
 	}
 
-	DPRINTF(("%s: state: %d -> %d\n", __func__, old_state, dev->protocol_state));
+	TRACEPOINT(TRACE_ABFR_STATE, &dev->device, old_state,
+	    dev->protocol_state);
+}
+
+/* A line that couldn't be parsed, checksum mismatches are counted apart */
+static void
+abfr_parse_failed(struct abfr_dev *dev)
+{
+	metrics_count(METRIC_ABFR_FAILURES + dev->protocol_state, 1);
+	dev->protocol_state = ABFR_FAIL;
 }
 
 static void
@@ -536,43 +387,58 @@ abfr_line_dev(struct abfr_dev *dev, char *line)
 	enum abfr_devtype device_type;
 
 	device_type = abfr_parsedev(line);
-	DPRINTF(("%s: device_type: %d\n", __func__, device_type));
+	TRACEPOINT(TRACE_ABFR_DEVICE_TYPE, &dev->device, device_type, 0);
 
 	/* Don't continue parsing if the device type isn't known. */
-	if (device_type == ABFR_DEV_UNKNOWN)
-		dev->protocol_state = ABFR_FAIL;
-	else
-		dev->protocol_state++;
+	if (device_type == ABFR_DEV_UNKNOWN) {
+		abfr_parse_failed(dev);
+		return;
+	}
+
+	/* A new download starts here */
+	abfr_release(dev);
+	dev->meter = g_strdup_printf("%s %s", dev->file, line);
+	dev->skipping = 0;
+	dev->protocol_state++;
 }
 
 static void
 abfr_line_soft(struct abfr_dev *dev, char *line)
 {
 	enum abfr_softrev softrev;
+	char *meter;
 
 	softrev = abfr_parsesoft(line);
-	DPRINTF(("%s: softrev: %d\n", __func__, softrev));
+	TRACEPOINT(TRACE_ABFR_SOFTREV, &dev->device, softrev, 0);
 
 	/* Don't continue parsing if the software revision isn't known. */
-	if (softrev == ABFR_SOFT_UNKNOWN)
-		dev->protocol_state = ABFR_FAIL;
-	else
-		dev->protocol_state++;
+	if (softrev == ABFR_SOFT_UNKNOWN) {
+		abfr_parse_failed(dev);
+		return;
+	}
+
+	/* The meter's model on this port, to find where downloads ended */
+	meter = g_strdup_printf("%s %s", dev->meter, line);
+	g_free(dev->meter);
+	dev->meter = meter;
+	dev->mark = meas_meter_mark(devicemgmt_db(&dev->device), dev->meter);
+
+	dev->protocol_state++;
 }
 
 static void
 abfr_line_date(struct abfr_dev *dev, char *line)
 {
-	struct tm device_tm;	
+	time_t device_time;
 	int r;
 
-	r = abfr_parsetime(line, &device_tm);
+	r = abfr_scanline(line, NULL, &device_time);
 	if (r == -1) {
-		dev->protocol_state = ABFR_FAIL;
+		abfr_parse_failed(dev);
 		return;
 	}
 
-	DPRINTF(("%s: currentdatetime\n", __func__));
+	TRACEPOINT(TRACE_ABFR_DATETIME, &dev->device, device_time, 0);
 	dev->protocol_state++;
 
 	return;
@@ -584,14 +450,23 @@ abfr_line_nresults(struct abfr_dev *dev, char *line)
 	int nresults;
 
 	nresults = abfr_nentries(line);
-	if (nresults == -1)
-		dev->protocol_state = ABFR_FAIL;
-	else
-		dev->protocol_state++;
+	if (nresults == -1) {
+		abfr_parse_failed(dev);
+		return;
+	}
 
 	dev->nresults = nresults;
 
-	DPRINTF(("%s: numberofresults\n", __func__));
+	if (dev->device.conf->ingest_staged) {
+		/* Results are sent to the writer a chunk at a time */
+		dev->download = meas_stage_begin(dev->device.conf);
+	} else {
+		/* Room for every result the meter announced, filled in order */
+		dev->batch = meas_batch_new(dev->file, nresults);
+	}
+	dev->protocol_state++;
+
+	TRACEPOINT(TRACE_ABFR_NRESULTS, &dev->device, nresults, 0);
 
 	return;
 }
@@ -599,35 +474,57 @@ abfr_line_nresults(struct abfr_dev *dev, char *line)
 static void
 abfr_line_result(struct abfr_dev *dev, char *line)
 {
-	int r;
-	struct abfr_entry *entry;
-
-	entry = calloc(1, sizeof(*entry));
-	if (entry == NULL) {
-		/* XXX: change to a fail state */
+	struct meas_record *rec;
+	time_t time;
+	int glucose, r;
+
+	/*
+	 * The meter sends its newest results first. Once we get to one we
+	 * already have, we have the rest too; they are only counted, as the
+	 * checksum still covers them. The mark alone doesn't say we have it,
+	 * another meter of the model may have set it, so below the mark each
+	 * result is looked up until one is stored. Those that aren't are
+	 * kept; inserting ignores one that is there after all.
+	 */
+	if (dev->skipping)
+		goto next;
+
+	r = abfr_scanline(line, &glucose, &time);
+	if (r == -1) {
+		abfr_parse_failed(dev);
 		return;
 	}
 
-	r = abfr_parse_entry(line, entry);
+	TRACEPOINT(TRACE_ABFR_RESULT, &dev->device, glucose, time);
+
+	if (time <= dev->mark && meas_stored(devicemgmt_db(&dev->device),
+	    dev->file, time, glucose)) {
+		TRACEPOINT(TRACE_ABFR_SKIP, &dev->device, time, dev->mark);
+		dev->skipping = 1;
+		goto next;
+	}
 
 	/* We can't insert the entry into the database at this point because
 	 * the checksum is calculated over all the messages thus we aren't sure
-	 * yet if this entry is correct. Instead put all the entries in a
-	 * linked list and insert them when the checksum can been verified. */
-	SLIST_INSERT_HEAD(&dev->entries, entry, next);
-
-	DPRINTF(("%s: glucose: %d\n", __func__, entry->bloodglucose));
-	DPRINTF(("%s: month: %d\n", __func__, entry->ptm.tm_mon));
-	DPRINTF(("%s: day: %d\n", __func__, entry->ptm.tm_mday));
-	DPRINTF(("%s: year: %d\n", __func__, entry->ptm.tm_year));
-	DPRINTF(("%s: hour: %d\n", __func__, entry->ptm.tm_hour));
-	DPRINTF(("%s: min: %d\n", __func__, entry->ptm.tm_min));
+	 * yet if this entry is correct. Instead collect the entries in the
+	 * batch and insert them when the checksum can been verified. With
+	 * staged ingest full batches are already sent to the writer, which
+	 * holds them back until then. */
+	if (dev->batch == NULL)
+		dev->batch = meas_batch_new(dev->file, ABFR_STAGE_CHUNK);
+	rec = &dev->batch->records[dev->batch->nrecords++];
+	rec->time = time;
+	rec->glucose = glucose;
+
+	if (dev->download != 0 && dev->batch->nrecords == dev->batch->size) {
+		meas_stage(dev->device.conf, dev->batch, dev->download);
+		dev->batch = NULL;
+	}
 
+next:
 	dev->results_processed++;
 	if (dev->results_processed >= dev->nresults)
 		dev->protocol_state = ABFR_END;
-
-	DPRINTF(("%s: result\n", __func__));
 }
 
 static void
@@ -638,35 +535,39 @@ abfr_line_end(struct abfr_dev *dev, char *line)
 
 	r = abfr_parse_checksum(line, &checksum);
 	if (r == -1) {
-		dev->protocol_state = ABFR_FAIL;
+		abfr_parse_failed(dev);
 		return;
 	}
 
-	if (dev->checksum == checksum) {
-		struct abfr_entry *e;
+	TRACEPOINT(TRACE_ABFR_CHECKSUM, &dev->device, dev->checksum, checksum);
 
+	if (dev->checksum == checksum) {
 		/* We are as sure as we can get that the entries are correct.
-		 * Insert them into the database */
-		while (!SLIST_EMPTY(&dev->entries)) {
-			e = SLIST_FIRST(&dev->entries);
-			SLIST_REMOVE_HEAD(&dev->entries, next);
-
-/*
-			meas_insert(dev->gm_state,
-				e->bloodglucose,
-				asctime(&e->ptm), "abfr");
-*/
-
-			free(e);
+		 * Insert them into the database in one go. The batch is the
+		 * writer's now. */
+		if (dev->download != 0) {
+			if (dev->batch != NULL)
+				meas_stage(dev->device.conf, dev->batch,
+				    dev->download);
+			meas_stage_promote(dev->device.conf, dev->file,
+			    dev->meter, dev->download, dev->results_processed);
+			dev->download = 0;
+			r = 0;
+		} else {
+			dev->batch->meter = g_strdup(dev->meter);
+			r = meas_insert_batch(dev->device.conf, dev->batch);
 		}
-
-		DPRINTF(("%s: checksum verified!\n", __func__));
+		dev->batch = NULL;
+		if (r == -1)
+			TRACEPOINT(TRACE_ABFR_INSERT_FAILED, &dev->device, 0,
+			    0);
 
 		dev->protocol_state = ABFR_DONE;
 
 		return;
 	}
 
+	metrics_count(METRIC_ABFR_CHECKSUM, 1);
 	dev->protocol_state = ABFR_FAIL;
 }
 
@@ -675,93 +576,111 @@ abfr_line_empty(struct abfr_dev *dev, char *line)
 {
 }
 
+/*
+ * Read straight from the file descriptor into the device's buffer, without
+ * GLib's buffering. Complete lines are terminated in place and parsed from
+ * the buffer; only the start of an unfinished line is moved to the front.
+ */
 static gboolean
 abfr_in(struct device *dev, GIOChannel *gio)
 {
-	GIOStatus	 status;
-	gsize		 terminator_pos;
-	GError		*error = NULL;
 	struct abfr_dev *abfr_dev = (struct abfr_dev *)dev;
-	GString		*line;
+	char		*line, *nl, *end;
+	size_t		 len;
+	ssize_t		 r;
 
 	if (!dev->is_processing) {
-		DPRINTF(("%s: the device isn't processing events. This "
-			"should've never been hit\n", __func__));
+		/* This should've never been hit */
+		TRACEPOINT(TRACE_ABFR_NOT_PROCESSING, dev, 0, 0);
 		return FALSE;
 	}
 
-	line = g_string_sized_new(100);
-
-	status = g_io_channel_read_line_string(gio, line, &terminator_pos, &error);
+	r = read(g_io_channel_unix_get_fd(gio),
+	    abfr_dev->inbuf + abfr_dev->inlen,
+	    sizeof(abfr_dev->inbuf) - abfr_dev->inlen);
+	if (r == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
 
-	if (status == G_IO_STATUS_ERROR) {
-		DPRINTF(("%s: error occured\n", __func__));
-		dev->is_processing = 0;
+		TRACEPOINT(TRACE_ABFR_READ_ERROR, dev, errno, 0);
+		devicemgmt_done(dev, DEVICE_ERROR);
 
 		return FALSE;
 	}
 
-	if (status == G_IO_STATUS_NORMAL) {
+	TRACEPOINT(TRACE_ABFR_READ, dev, r, 0);
+
+	abfr_dev->inlen += r;
+	dev->bytes_read += r;
+	line = abfr_dev->inbuf;
+	end = abfr_dev->inbuf + abfr_dev->inlen;
+
+	while (abfr_dev->protocol_state != ABFR_DONE &&
+	    abfr_dev->protocol_state != ABFR_FAIL &&
+	    (nl = memchr(line, '\n', end - line)) != NULL) {
+		len = nl - line + 1;
+		dev->lines_read++;
+
 		/* Calculate the checksum before the newline terminators are cut off */
 		if (abfr_dev->protocol_state != ABFR_END)
-			abfr_dev->checksum += abfr_calc_checksum(line->str);
+			abfr_dev->checksum += abfr_calc_checksum(line, len);
 
 		/* Cut off the newline terminators */
-		line = g_string_truncate(line, terminator_pos);
+		len--;
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		line[len] = '\0';
+
+		TRACEPOINT(TRACE_ABFR_LINE, dev, len, trace_text(line, len));
 
-		DPRINTF(("%s: line(%zu): \"%s\"\n", __func__, line->len, line->str));
+		if (len > 0)
+			abfr_parseline(abfr_dev, line);
 
-		if (line->len > 0)
-			abfr_parseline(abfr_dev, line->str);
+		line = nl + 1;
 	}
 
-	g_string_free(line, TRUE);
+	abfr_dev->inlen = end - line;
+	memmove(abfr_dev->inbuf, line, abfr_dev->inlen);
+
+	if (abfr_dev->inlen == sizeof(abfr_dev->inbuf)) {
+		TRACEPOINT(TRACE_ABFR_LINE_LONG, dev, abfr_dev->inlen, 0);
+		abfr_parse_failed(abfr_dev);
+	}
 
-	if (status == G_IO_STATUS_EOF || abfr_dev->protocol_state == ABFR_DONE ||
+	if (r == 0 || abfr_dev->protocol_state == ABFR_DONE ||
 		abfr_dev->protocol_state == ABFR_FAIL) {
 
-		dev->is_processing = 0;
-		
+		/* This stops the device, see abfr_stop() */
+		if (abfr_dev->protocol_state == ABFR_DONE)
+			devicemgmt_done(dev, DEVICE_DONE);
+		else if (abfr_dev->protocol_state == ABFR_FAIL)
+			devicemgmt_done(dev, DEVICE_FAILED);
+		else
+			devicemgmt_done(dev, DEVICE_ERROR);
+
 		return FALSE;
 	}
 
+	devicemgmt_deadline(dev, abfr_timeouts[abfr_dev->protocol_state]);
+
 	return TRUE;
 }
 
+/* The "mem" command went out */
 static gboolean
 abfr_out(struct device *dev, GIOChannel *gio)
 {
-	gchar		 buf[] = "mem";
-	gsize		 wrote_len;
-	GError		*error = NULL;
-	GIOStatus	 status;
-	struct abfr_dev *abfr_dev = (struct abfr_dev *)dev;
-
-	if (!dev->is_processing) {
-		DPRINTF(("%s: the device isn't processing events. This "
-			"should've never been hit\n", __func__));
-		return FALSE;
-	}
+	TRACEPOINT(TRACE_ABFR_SENT, dev, 0, 0);
 
-	if (abfr_dev->protocol_state != ABFR_SEND_MEM) {
-		return FALSE;
-	}
-
-	status = g_io_channel_write_chars(gio, buf, -1, &wrote_len, &error);
-
-	g_io_channel_flush(gio, NULL);
-
-	DPRINTF(("%s: bytes written: %zu status: %d\n", __func__, wrote_len, status));
-
-	abfr_dev->protocol_state++;
-
-	return TRUE;
+	return FALSE;
 }
 
 static gboolean
 abfr_error(struct device *dev, GIOChannel *gio)
 {
-	printf("error\n");
+	TRACEPOINT(TRACE_ABFR_PORT_ERROR, dev, 0, 0);
 
-	return TRUE;
+	devicemgmt_done(dev, DEVICE_ERROR);
+
+	return FALSE;
 }
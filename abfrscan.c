@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The date and result lines of the abfr protocol share their layout, so one
+ * scanner reads both in a single pass over the line, without copying or
+ * modifying it.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+#define ABFR_MON(a, b, c)	((a) << 16 | (b) << 8 | (c))
+
+/* A decimal number in [min, max] */
+static const char *
+abfr_scan_num(const char *p, int min, int max, int *v)
+{
+	int	 n = 0;
+
+	if (*p < '0' || *p > '9')
+		return NULL;
+
+	for (; *p >= '0' && *p <= '9'; p++) {
+		n = n * 10 + (*p - '0');
+		if (n > max)
+			return NULL;
+	}
+
+	if (n < min)
+		return NULL;
+
+	*v = n;
+
+	return p;
+}
+
+/* The meters pad their fields with one or more spaces */
+static const char *
+abfr_scan_space(const char *p)
+{
+	if (*p != ' ')
+		return NULL;
+
+	while (*p == ' ')
+		p++;
+
+	return p;
+}
+
+/* Month names as the meters spell them, 1 is January */
+static const char *
+abfr_scan_month(const char *p, int *mon)
+{
+	if (p[0] == '\0' || p[1] == '\0')
+		return NULL;
+
+	switch (ABFR_MON(p[0], p[1], p[2])) {
+	case ABFR_MON('J', 'a', 'n'):
+		*mon = 1;
+		break;
+	case ABFR_MON('F', 'e', 'b'):
+		*mon = 2;
+		break;
+	case ABFR_MON('M', 'a', 'r'):
+		*mon = 3;
+		break;
+	case ABFR_MON('A', 'p', 'r'):
+		*mon = 4;
+		break;
+	case ABFR_MON('M', 'a', 'y'):
+		*mon = 5;
+		break;
+	case ABFR_MON('J', 'u', 'n'):
+		if (p[3] != 'e')
+			return NULL;
+		*mon = 6;
+		return p + 4;
+	case ABFR_MON('J', 'u', 'l'):
+		if (p[3] != 'y')
+			return NULL;
+		*mon = 7;
+		return p + 4;
+	case ABFR_MON('A', 'u', 'g'):
+		*mon = 8;
+		break;
+	case ABFR_MON('S', 'e', 'p'):
+		*mon = 9;
+		break;
+	case ABFR_MON('O', 'c', 't'):
+		*mon = 10;
+		break;
+	case ABFR_MON('N', 'o', 'v'):
+		*mon = 11;
+		break;
+	case ABFR_MON('D', 'e', 'c'):
+		*mon = 12;
+		break;
+	default:
+		return NULL;
+	}
+
+	return p + 3;
+}
+
+/* Days since 1970-01-01 in the proleptic Gregorian calendar */
+static int64_t
+abfr_days(int year, int mon, int mday)
+{
+	int64_t	 era, yoe, doy, doe;
+
+	if (mon <= 2)
+		year--;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * Scan a result line, "234  Jan  17 2010 00:39 00 0x00", or with glucose
+ * set to NULL the current date line, "Jan  21 2010 20:40:00". The time is
+ * returned in seconds since the epoch, reading the meter's clock as UTC.
+ */
+int
+abfr_scanline(const char *p, int *glucose, time_t *time)
+{
+	int	 mon, mday, year, hour, min, sec = 0;
+
+	if (glucose != NULL) {
+		/* XXX: change 400 to sth decent */
+		if ((p = abfr_scan_num(p, 0, 400, glucose)) == NULL ||
+		    (p = abfr_scan_space(p)) == NULL)
+			return -1;
+	}
+
+	if ((p = abfr_scan_month(p, &mon)) == NULL ||
+	    (p = abfr_scan_space(p)) == NULL ||
+	    (p = abfr_scan_num(p, 1, 31, &mday)) == NULL ||
+	    (p = abfr_scan_space(p)) == NULL ||
+	    (p = abfr_scan_num(p, 0, 9999, &year)) == NULL ||
+	    (p = abfr_scan_space(p)) == NULL ||
+	    (p = abfr_scan_num(p, 0, 23, &hour)) == NULL ||
+	    *p++ != ':' ||
+	    (p = abfr_scan_num(p, 0, 59, &min)) == NULL)
+		return -1;
+
+	if (glucose == NULL) {
+		if (*p++ != ':' ||
+		    (p = abfr_scan_num(p, 0, 59, &sec)) == NULL ||
+		    *p != '\0')
+			return -1;
+	} else if (*p != ' ')
+		return -1;
+
+	*time = abfr_days(year, mon, mday) * 86400 + hour * 3600 + min * 60 +
+	    sec;
+
+	return 0;
+}
+
+/* The meters sum every byte they send before the END line */
+uint16_t
+abfr_calc_checksum(const char *line, size_t len)
+{
+	size_t i;
+	uint16_t checksum = 0;
+
+	for (i = 0; i < len; i++)
+		checksum += line[i];
+
+	return checksum;
+}
@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Virtual abfr meters on pseudo-terminals, to run the driver without
+ * hardware. Every meter answers "mem" with a complete download: device
+ * type, software revision, date, result count, the results newest first
+ * and the checksum line. Each download adds new readings, so repeated
+ * downloads look like a meter that is in use.
+ *
+ * The configuration lines for the meters are printed on stdout.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+#define SIM_MAX_METERS		1024
+#define SIM_MAX_ENTRIES		450	/* ABFR_MAX_ENTRIES */
+#define SIM_INTERVAL		(4 * 3600)	/* s, between readings */
+#define SIM_STALL		10	/* times the line pacing */
+
+enum sim_fault {
+	SIM_FAULT_CHECKSUM	= 1 << 0,	/* wrong checksum */
+	SIM_FAULT_GARBAGE	= 1 << 1,	/* a result line that doesn't parse */
+	SIM_FAULT_TRUNCATE	= 1 << 2,	/* stop halfway */
+	SIM_FAULT_STALL		= 1 << 3,	/* pause halfway */
+};
+
+struct sim_fault_name {
+	const char	*name;
+	int		 fault;
+};
+
+static struct sim_fault_name sim_fault_names[] = {
+	{ "checksum",	SIM_FAULT_CHECKSUM },
+	{ "garbage",	SIM_FAULT_GARBAGE },
+	{ "truncate",	SIM_FAULT_TRUNCATE },
+	{ "stall",	SIM_FAULT_STALL },
+};
+
+/* What the known meters say about themselves */
+struct sim_type {
+	const char	*type;
+	const char	*rev;
+};
+
+static struct sim_type sim_types[] = {
+	{ "DBMN169-C4824", "1.43       -P" },	/* FreeStyle Lite */
+	{ "DAMH359-63524", "4.0100     -P" },	/* FreeStyle Mini */
+	{ "CDMK311-B0764", "0.31-P1-B0764" },	/* FreeStyle Freedom Lite */
+};
+
+struct sim_meter {
+	int		 master;
+	int		 slave;
+	char		 path[64];
+	struct sim_type	*type;
+	time_t		 newest;	/* newest reading */
+	int		 downloads;
+
+	char		 in[64];
+	size_t		 inlen;
+
+	char		*out;
+	size_t		 outlen;
+	size_t		 outoff;
+	size_t		 stall;		/* offset to pause at, 0 if none */
+	int64_t		 next;		/* us, the next line may go out */
+};
+
+struct sim_conf {
+	int		 nmeters;
+	int		 entries;
+	int		 pace;		/* ms between lines */
+	int		 baud;		/* 0 is as fast as possible */
+	int		 faultrate;	/* percent of downloads */
+	int		 faults;
+	int		 newreadings;	/* per download */
+};
+
+struct sim_stats {
+	unsigned long	 downloads;
+	unsigned long	 lines;
+	unsigned long	 faults;
+};
+
+static volatile sig_atomic_t	 sim_quit;
+static struct sim_stats		 sim_stats;
+
+static const char *sim_months[] = { "Jan", "Feb", "Mar", "Apr", "May",
+    "June", "July", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: abfrsim [-b baud] [-e entries] [-F faults] "
+	    "[-f percent]\n"
+	    "               [-l linkdir] [-n meters] [-p pace] "
+	    "[-r readings] [-s seed]\n");
+	exit(1);
+}
+
+static int64_t
+sim_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sim_sigint(int sig)
+{
+	sim_quit = 1;
+}
+
+static int
+sim_parse_faults(char *list)
+{
+	char	*p;
+	size_t	 i;
+	int	 faults = 0;
+
+	while ((p = strsep(&list, ",")) != NULL) {
+		for (i = 0; i < sizeof(sim_fault_names) /
+		    sizeof(sim_fault_names[0]); i++)
+			if (strcmp(p, sim_fault_names[i].name) == 0)
+				break;
+		if (i == sizeof(sim_fault_names) / sizeof(sim_fault_names[0]))
+			errx(1, "unknown fault: %s", p);
+		faults |= sim_fault_names[i].fault;
+	}
+
+	return faults;
+}
+
+/* Append a line, terminated the way the meters do */
+static void
+sim_line(char **buf, size_t *len, size_t *size, const char *fmt, ...)
+{
+	va_list	 ap;
+	int	 n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			err(1, "vsnprintf");
+		if ((size_t)n + 2 < *size - *len)
+			break;
+
+		*size *= 2;
+		if ((*buf = realloc(*buf, *size)) == NULL)
+			err(1, "realloc");
+	}
+
+	*len += n;
+	memcpy(*buf + *len, "\r\n", 2);
+	*len += 2;
+}
+
+static void
+sim_time(char *buf, size_t len, time_t t, int seconds)
+{
+	struct tm	 tm;
+
+	gmtime_r(&t, &tm);
+	if (seconds)
+		snprintf(buf, len, "%-4s %02d %04d %02d:%02d:%02d",
+		    sim_months[tm.tm_mon], tm.tm_mday, tm.tm_year + 1900,
+		    tm.tm_hour, tm.tm_min, tm.tm_sec);
+	else
+		snprintf(buf, len, "%-4s %02d %04d %02d:%02d",
+		    sim_months[tm.tm_mon], tm.tm_mday, tm.tm_year + 1900,
+		    tm.tm_hour, tm.tm_min);
+}
+
+/*
+ * Build the answer to "mem", with a fault thrown in now and then.
+ */
+static void
+sim_download(struct sim_conf *conf, struct sim_meter *m)
+{
+	char		 date[32];
+	size_t		 size = 4096, i, half;
+	uint16_t	 checksum;
+	time_t		 t;
+	int		 fault = 0, bad = -1, n;
+
+	if (conf->faults && (int)(random() % 100) < conf->faultrate) {
+		do {
+			fault = 1 << (random() % 4);
+		} while (!(conf->faults & fault));
+		sim_stats.faults++;
+	}
+
+	if (m->downloads++ > 0)
+		m->newest += conf->newreadings * SIM_INTERVAL;
+
+	free(m->out);
+	if ((m->out = malloc(size)) == NULL)
+		err(1, "malloc");
+	m->outlen = m->outoff = m->stall = 0;
+
+	n = conf->entries;
+	if (fault == SIM_FAULT_GARBAGE)
+		bad = random() % n;
+
+	sim_line(&m->out, &m->outlen, &size, "%s", "");
+	sim_line(&m->out, &m->outlen, &size, "%s", m->type->type);
+	sim_line(&m->out, &m->outlen, &size, "%s", m->type->rev);
+	sim_time(date, sizeof(date), time(NULL), 1);
+	sim_line(&m->out, &m->outlen, &size, "%s", date);
+	sim_line(&m->out, &m->outlen, &size, "%03d", n);
+
+	half = 0;
+	for (i = 0; i < (size_t)n; i++) {
+		if (i == (size_t)n / 2)
+			half = m->outlen;
+
+		t = m->newest - i * SIM_INTERVAL;
+		sim_time(date, sizeof(date), t, 0);
+		if ((int)i == bad)
+			sim_line(&m->out, &m->outlen, &size,
+			    "%03d  Foo  99 %s 00 0x00", 100, date);
+		else
+			sim_line(&m->out, &m->outlen, &size,
+			    "%03ld  %s 00 0x00", 40 + (t / SIM_INTERVAL) % 300,
+			    date);
+	}
+
+	for (checksum = 0, i = 0; i < m->outlen; i++)
+		checksum += m->out[i];
+	if (fault == SIM_FAULT_CHECKSUM)
+		checksum ^= 0x5a5a;
+	sim_line(&m->out, &m->outlen, &size, "0x%04X  END", checksum);
+
+	if (fault == SIM_FAULT_TRUNCATE)
+		m->outlen = half;
+	if (fault == SIM_FAULT_STALL)
+		m->stall = half;
+
+	sim_stats.downloads++;
+}
+
+static void
+sim_input(struct sim_conf *conf, struct sim_meter *m)
+{
+	ssize_t	 r;
+
+	r = read(m->master, m->in + m->inlen, sizeof(m->in) - m->inlen - 1);
+	if (r <= 0) {
+		if (r == -1 && errno != EAGAIN && errno != EINTR && errno != EIO)
+			warn("%s", m->path);
+		return;
+	}
+
+	m->inlen += r;
+	m->in[m->inlen] = '\0';
+
+	if (strstr(m->in, "mem") != NULL) {
+		m->inlen = 0;
+		sim_download(conf, m);
+		m->next = sim_now();
+	} else if (m->inlen == sizeof(m->in) - 1) {
+		/* Keep the tail, "mem" could be split over two reads */
+		memmove(m->in, m->in + m->inlen - 2, 2);
+		m->inlen = 2;
+	}
+}
+
+/* Send the next line, paced by the line delay and the baud rate */
+static void
+sim_output(struct sim_conf *conf, struct sim_meter *m, int64_t now)
+{
+	char	*nl;
+	size_t	 len;
+	ssize_t	 r;
+	int64_t	 delay;
+
+	nl = memchr(m->out + m->outoff, '\n', m->outlen - m->outoff);
+	len = nl != NULL ? (size_t)(nl - (m->out + m->outoff)) + 1 :
+	    m->outlen - m->outoff;
+
+	r = write(m->master, m->out + m->outoff, len);
+	if (r == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			warn("%s", m->path);
+		return;
+	}
+	m->outoff += r;
+	if ((size_t)r < len)
+		return;
+
+	sim_stats.lines++;
+
+	delay = (int64_t)conf->pace * 1000;
+	if (conf->baud > 0)
+		delay += (int64_t)len * 10 * 1000000 / conf->baud;
+	if (m->stall != 0 && m->outoff == m->stall)
+		delay += (int64_t)SIM_STALL * (conf->pace > 0 ? conf->pace : 100) *
+		    1000;
+	m->next = now + delay;
+
+	if (m->outoff == m->outlen) {
+		free(m->out);
+		m->out = NULL;
+		m->outlen = m->outoff = 0;
+	}
+}
+
+static void
+sim_open(struct sim_meter *m, int index, const char *linkdir)
+{
+	struct termios	 ts;
+	char		 name[64];
+
+	/* Raw, so nothing echoes the driver's commands back */
+	bzero(&ts, sizeof(ts));
+	cfmakeraw(&ts);
+	cfsetspeed(&ts, B19200);
+
+	if (openpty(&m->master, &m->slave, name, &ts, NULL) == -1)
+		err(1, "openpty");
+
+	/* Holding the slave open keeps the master usable between downloads */
+	if (fcntl(m->master, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	if (linkdir != NULL) {
+		snprintf(m->path, sizeof(m->path), "%s/abfr%d", linkdir, index);
+		unlink(m->path);
+		if (symlink(name, m->path) == -1)
+			err(1, "symlink %s", m->path);
+	} else
+		strlcpy(m->path, name, sizeof(m->path));
+
+	m->type = &sim_types[index % (sizeof(sim_types) / sizeof(sim_types[0]))];
+	m->newest = time(NULL) / 60 * 60 - index * 60;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sim_conf		 conf;
+	struct sim_meter	*meters, *m;
+	struct pollfd		*pfds;
+	const char		*errstr, *linkdir = NULL;
+	int64_t			 now, wait;
+	unsigned int		 seed = 1;
+	int			 ch, i, timeout;
+
+	bzero(&conf, sizeof(conf));
+	conf.nmeters = 1;
+	conf.entries = SIM_MAX_ENTRIES;
+	conf.newreadings = 1;
+	conf.faults = SIM_FAULT_CHECKSUM | SIM_FAULT_GARBAGE |
+	    SIM_FAULT_TRUNCATE | SIM_FAULT_STALL;
+
+	while ((ch = getopt(argc, argv, "b:e:F:f:l:n:p:r:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			conf.baud = strtonum(optarg, 0, 4000000, &errstr);
+			if (errstr)
+				errx(1, "baud rate is %s: %s", errstr, optarg);
+			break;
+		case 'e':
+			conf.entries = strtonum(optarg, 1, SIM_MAX_ENTRIES,
+			    &errstr);
+			if (errstr)
+				errx(1, "entries is %s: %s", errstr, optarg);
+			break;
+		case 'F':
+			conf.faults = sim_parse_faults(optarg);
+			break;
+		case 'f':
+			conf.faultrate = strtonum(optarg, 0, 100, &errstr);
+			if (errstr)
+				errx(1, "fault rate is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			linkdir = optarg;
+			break;
+		case 'n':
+			conf.nmeters = strtonum(optarg, 1, SIM_MAX_METERS,
+			    &errstr);
+			if (errstr)
+				errx(1, "meters is %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			conf.pace = strtonum(optarg, 0, 60000, &errstr);
+			if (errstr)
+				errx(1, "pace is %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			conf.newreadings = strtonum(optarg, 0, SIM_MAX_ENTRIES,
+			    &errstr);
+			if (errstr)
+				errx(1, "readings is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			seed = strtonum(optarg, 0, UINT32_MAX, &errstr);
+			if (errstr)
+				errx(1, "seed is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if (argc != 0)
+		usage();
+
+	srandom(seed);
+
+	if ((meters = calloc(conf.nmeters, sizeof(*meters))) == NULL ||
+	    (pfds = calloc(conf.nmeters, sizeof(*pfds))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < conf.nmeters; i++) {
+		sim_open(&meters[i], i, linkdir);
+		printf("glucosemeter abfr \"%s\"\n", meters[i].path);
+	}
+	fflush(stdout);
+
+	signal(SIGINT, sim_sigint);
+	signal(SIGTERM, sim_sigint);
+
+	while (!sim_quit) {
+		now = sim_now();
+		timeout = -1;
+
+		for (i = 0; i < conf.nmeters; i++) {
+			m = &meters[i];
+			pfds[i].fd = m->master;
+			pfds[i].events = POLLIN;
+			if (m->out == NULL)
+				continue;
+
+			wait = m->next - now;
+			if (wait <= 0) {
+				pfds[i].events |= POLLOUT;
+				timeout = 0;
+			} else if (timeout == -1 || wait / 1000 + 1 < timeout)
+				timeout = wait / 1000 + 1;
+		}
+
+		if (poll(pfds, conf.nmeters, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		now = sim_now();
+		for (i = 0; i < conf.nmeters; i++) {
+			m = &meters[i];
+			if (pfds[i].revents & POLLIN)
+				sim_input(&conf, m);
+			if (m->out != NULL && (pfds[i].revents & POLLOUT) &&
+			    m->next <= now)
+				sim_output(&conf, m, now);
+		}
+	}
+
+	for (i = 0; i < conf.nmeters; i++) {
+		if (linkdir != NULL)
+			unlink(meters[i].path);
+		close(meters[i].master);
+		close(meters[i].slave);
+		free(meters[i].out);
+	}
+
+	fprintf(stderr, "abfrsim: %lu downloads, %lu lines, %lu faults\n",
+	    sim_stats.downloads, sim_stats.lines, sim_stats.faults);
+
+	return 0;
+}
@@ -0,0 +1,802 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks of the ingest path: parsing and checksumming result lines, the
+ * abfr_in() line loop on a canned download, inserting readings one at a
+ * time and batched, and refreshing the model over 10k, 100k and 1M rows.
+ * Statistics over those rows are taken from the in-memory cache and from
+ * the rollups, after checking the cache's vector kernels against plain C.
+ *
+ * Every benchmark takes a number of samples of the same seeded workload.
+ * The results are written to stdout as JSON, with percentiles of the time
+ * per operation; a summary goes to stderr. With names given only the
+ * benchmarks starting with one of them are run.
+ *
+ * The databases are created in a temporary directory, which is removed
+ * afterwards.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+#define BENCH_LINES	4096
+#define BENCH_SAMPLES	20
+#define BENCH_START	1262304000	/* 2010-01-01, the oldest reading */
+#define BENCH_INTERVAL	300		/* s, between readings */
+#define BENCH_FILL_ROWS	4096		/* per transaction */
+
+struct bench {
+	int		 nsamples;
+	char		**names;
+	int		 nnames;
+	int		 reported;
+	double		*samples;
+	time_t		 newest;	/* newest reading inserted */
+	FILE		*json;
+};
+
+static const char *bench_months[] = { "Jan", "Feb", "Mar", "Apr", "May",
+    "June", "July", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Keeps the compiler from dropping the work */
+static volatile long	 bench_sink;
+
+struct monthlist {
+	char	*month;
+	int 	 number;
+};
+
+static int
+month_cmp(const void *k, const void *e)
+{
+        return (strcmp(k, ((const struct monthlist *)e)->month));
+}
+
+/* The old parser, as it was */
+static int
+legacy_parse_entry(char *p, int *glucose, struct tm *ptm)
+{
+	char			*p2;
+	const char		*errstr;
+	struct monthlist	*m;
+	int			 yearint;
+
+	/* Keep sorted */
+	struct monthlist mlist[] = {
+		{ "Apr", 3 },
+		{ "Aug", 7 },
+		{ "Dec", 11 },
+		{ "Feb", 1 },
+		{ "Jan", 0 },
+		{ "July", 6 },
+		{ "June", 5 },
+		{ "Mar", 2 },
+		{ "May", 4 },
+		{ "Nov", 10 },
+		{ "Oct", 9 },
+		{ "Sep", 8 },
+	};
+
+	p2 = p;
+	p = strsep(&p2, " ");
+	if (p2 == NULL)
+		goto fail;
+
+	errstr = NULL;
+	*glucose = strtonum(p, 0, 400, &errstr);
+	if (errstr)
+		goto fail;
+
+	if (*p2 == ' ')
+		p2++;
+
+	p = strsep(&p2, " ");
+	if (p2 == NULL)
+		goto fail;
+
+	m = bsearch(p, mlist, sizeof(mlist)/sizeof(mlist[0]),
+		sizeof(mlist[0]), month_cmp);
+
+	if (!m)
+		goto fail;
+
+	ptm->tm_mon = m->number;
+
+	if (*p2 == ' ')
+		p2++;
+
+	p = strsep(&p2, " ");
+	if (p2 == NULL)
+		goto fail;
+
+	errstr = NULL;
+	ptm->tm_mday = strtonum(p, 1, 31, &errstr);
+	if (errstr)
+		goto fail;
+
+	p = strsep(&p2, " ");
+	if (p2 == NULL)
+		goto fail;
+
+	errstr = NULL;
+	yearint = strtonum(p, 0, 9999, &errstr);
+	if (errstr)
+		goto fail;
+	ptm->tm_year = yearint - 1900;
+
+	p = strsep(&p2, ":");
+	if (p2 == NULL)
+		goto fail;
+
+	errstr = NULL;
+	ptm->tm_hour = strtonum(p, 0, 23, &errstr);
+	if (errstr)
+		goto fail;
+
+	p = strsep(&p2, " ");
+	if (p2 == NULL)
+		goto fail;
+
+	errstr = NULL;
+	ptm->tm_min = strtonum(p, 0, 59, &errstr);
+	if (errstr)
+		goto fail;
+
+	return (0);
+fail:
+	return (-1);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench [-s samples] [name ...]\n");
+	exit(1);
+}
+
+static int
+bench_enabled(struct bench *b, const char *name)
+{
+	int	 i;
+
+	if (b->nnames == 0)
+		return 1;
+
+	for (i = 0; i < b->nnames; i++)
+		if (strncmp(name, b->names[i], strlen(b->names[i])) == 0)
+			return 1;
+
+	return 0;
+}
+
+/* Whether anything in a group of benchmarks is to be run */
+static int
+bench_group(struct bench *b, const char *group)
+{
+	size_t	 len = strlen(group);
+	int	 i;
+
+	if (bench_enabled(b, group))
+		return 1;
+
+	for (i = 0; i < b->nnames; i++)
+		if (strncmp(b->names[i], group, len) == 0)
+			return 1;
+
+	return 0;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double	 x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank */
+static double
+bench_percentile(double *samples, int n, int p)
+{
+	int	 i;
+
+	i = (p * n + 99) / 100 - 1;
+
+	return samples[i < 0 ? 0 : i];
+}
+
+/*
+ * Report the samples of one benchmark, each being the time in seconds ops
+ * operations took.
+ */
+static void
+bench_report(struct bench *b, const char *name, const char *unit, int ops)
+{
+	double	*s = b->samples, mean = 0;
+	int	 i, n = b->nsamples;
+
+	qsort(s, n, sizeof(*s), bench_cmp);
+	for (i = 0; i < n; i++) {
+		s[i] = s[i] * 1e9 / ops;
+		mean += s[i] / n;
+	}
+
+	fprintf(b->json, "%s\n    { \"name\": \"%s\", \"unit\": \"%s\", \"ops\": %d, "
+	    "\"samples\": %d,\n      \"min_ns\": %.1f, \"p50_ns\": %.1f, "
+	    "\"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f,\n"
+	    "      \"mean_ns\": %.1f, \"per_sec\": %.0f }",
+	    b->reported++ ? "," : "", name, unit, ops, n, s[0],
+	    bench_percentile(s, n, 50), bench_percentile(s, n, 90),
+	    bench_percentile(s, n, 99), s[n - 1], mean,
+	    1e9 / bench_percentile(s, n, 50));
+	fflush(b->json);
+
+	fprintf(stderr, "%-32s %14.0f %s/s\n", name,
+	    1e9 / bench_percentile(s, n, 50), unit);
+}
+
+static void
+bench_lines(char lines[][ABFR_ENTRYLEN + 16], int n)
+{
+	int	 i;
+
+	srandom(1);
+	for (i = 0; i < n; i++)
+		snprintf(lines[i], sizeof(lines[i]),
+		    "%03ld  %-4s %02ld %ld %02ld:%02ld 00 0x00",
+		    20 + random() % 381, bench_months[i % 12],
+		    1 + random() % 28, 2008 + random() % 5, random() % 24,
+		    random() % 60);
+}
+
+/* A complete download of n results, as a FreeStyle Lite sends it */
+static size_t
+bench_download(char *buf, size_t size, int n)
+{
+	struct tm	 tm;
+	size_t		 len, i;
+	uint16_t	 checksum;
+	time_t		 t;
+	int		 j;
+
+	len = snprintf(buf, size, "\r\nDBMN169-C4824\r\n1.43       -P\r\n"
+	    "Jan  21 2010 20:40:00\r\n%03d\r\n", n);
+
+	for (j = 0; j < n; j++) {
+		t = BENCH_START - j * BENCH_INTERVAL;
+		gmtime_r(&t, &tm);
+		len += snprintf(buf + len, size - len,
+		    "%03ld  %-4s %02d %d %02d:%02d 00 0x00\r\n",
+		    40 + random() % 300, bench_months[tm.tm_mon], tm.tm_mday,
+		    tm.tm_year + 1900, tm.tm_hour, tm.tm_min);
+	}
+
+	for (checksum = 0, i = 0; i < len; i++)
+		checksum += buf[i];
+	len += snprintf(buf + len, size - len, "0x%04X  END\r\n", checksum);
+
+	if (len >= size)
+		errx(1, "download doesn't fit");
+
+	return len;
+}
+
+static void
+bench_scanline(struct bench *b)
+{
+	static char	 lines[BENCH_LINES][ABFR_ENTRYLEN + 16];
+	char		 buf[ABFR_ENTRYLEN + 16];
+	struct tm	 tm;
+	time_t		 t;
+	double		 start;
+	int		 i, j, glucose, glucose2;
+
+	bench_lines(lines, BENCH_LINES);
+
+	/* Both have to agree before their speed means anything */
+	for (i = 0; i < BENCH_LINES; i++) {
+		strlcpy(buf, lines[i], sizeof(buf));
+		bzero(&tm, sizeof(tm));
+		if (legacy_parse_entry(buf, &glucose, &tm) == -1 ||
+		    abfr_scanline(lines[i], &glucose2, &t) == -1 ||
+		    glucose != glucose2 || timegm(&tm) != t)
+			errx(1, "mismatch: \"%s\"", lines[i]);
+	}
+
+	if (bench_enabled(b, "abfr_scanline/legacy")) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			for (i = 0; i < BENCH_LINES; i++) {
+				/* strsep writes into the line */
+				strlcpy(buf, lines[i], sizeof(buf));
+				bzero(&tm, sizeof(tm));
+				legacy_parse_entry(buf, &glucose, &tm);
+				bench_sink += timegm(&tm) + glucose;
+			}
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, "abfr_scanline/legacy", "line", BENCH_LINES);
+	}
+
+	if (bench_enabled(b, "abfr_scanline/scanner")) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			for (i = 0; i < BENCH_LINES; i++) {
+				abfr_scanline(lines[i], &glucose, &t);
+				bench_sink += t + glucose;
+			}
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, "abfr_scanline/scanner", "line", BENCH_LINES);
+	}
+}
+
+static void
+bench_checksum(struct bench *b)
+{
+	static char	 stream[ABFR_MAX_ENTRIES * 64];
+	size_t		 len;
+	double		 start;
+	int		 i, j;
+
+	if (!bench_enabled(b, "abfr_calc_checksum"))
+		return;
+
+	len = bench_download(stream, sizeof(stream), ABFR_MAX_ENTRIES);
+
+	for (j = 0; j < b->nsamples; j++) {
+		start = bench_now();
+		for (i = 0; i < 100; i++)
+			bench_sink += abfr_calc_checksum(stream, len);
+		b->samples[j] = bench_now() - start;
+	}
+	bench_report(b, "abfr_calc_checksum", "byte", 100 * len);
+}
+
+/* A database of our own, set up the way main() does */
+static void
+bench_db_open(struct gm_conf *conf, const char *dir)
+{
+	if (dir != NULL && (mkdir(dir, 0700) == -1 || chdir(dir) == -1))
+		err(1, "%s", dir);
+
+	bzero(conf, sizeof(*conf));
+	devicemgmt_init(conf);
+	conf->commit_window = DBWRITER_COMMIT_WINDOW;
+	conf->commit_limit = DBWRITER_COMMIT_LIMIT;
+
+	if (sqlite3_open(GM_DATABASE_FILE, &conf->db.handle) != SQLITE_OK)
+		errx(1, "%s: cannot open", GM_DATABASE_FILE);
+
+	conf->measurements = meas_model(conf);
+	if (conf->measurements == NULL)
+		errx(1, "%s: cannot load", GM_DATABASE_FILE);
+}
+
+/* Closes the database, and with dir set deletes it */
+static void
+bench_db_close(struct gm_conf *conf, const char *dir)
+{
+	g_object_unref(conf->measurements);
+	conf->measurements = NULL;
+	meas_close(conf);
+
+	if (dir == NULL)
+		return;
+
+	unlink(GM_DATABASE_FILE);
+	unlink(GM_DATABASE_FILE "-wal");
+	unlink(GM_DATABASE_FILE "-shm");
+	unlink(GM_SNAPSHOT_FILE);
+	unlink("download");
+	if (chdir("..") == -1 || rmdir(dir) == -1)
+		err(1, "%s", dir);
+}
+
+/* Readings newer than any so far, for the next n inserts */
+static struct meas_batch *
+bench_batch(struct bench *b, const char *device, int n)
+{
+	struct meas_batch	*batch;
+	int			 i;
+
+	batch = meas_batch_new(device, n);
+	for (i = 0; i < n; i++) {
+		b->newest += BENCH_INTERVAL;
+		batch->records[i].time = b->newest;
+		batch->records[i].glucose = 40 + random() % 300;
+	}
+	batch->nrecords = n;
+
+	return batch;
+}
+
+/* Insert n readings directly, in transactions of at most limit readings */
+static void
+bench_db_fill(struct bench *b, struct gm_conf *conf, int n, int limit)
+{
+	struct meas_batch	*batch;
+	int			 i;
+
+	for (i = 0; i < n; i += limit) {
+		batch = bench_batch(b, "bench", MIN(limit, n - i));
+		if (meas_db_begin(&conf->db) == -1 ||
+		    meas_db_apply(&conf->db, batch) == -1 ||
+		    meas_db_commit(&conf->db) == -1)
+			errx(1, "inserting readings failed");
+		meas_batch_free(batch);
+	}
+}
+
+/* The readings the writer committed so far */
+static guint64
+bench_writer_records(struct gm_conf *conf)
+{
+	struct dbwriter_stats	 st;
+
+	dbwriter_stats(conf->writer, &st);
+
+	return st.records;
+}
+
+/* Wait for the writer to have committed n readings in all */
+static void
+bench_writer_wait(struct gm_conf *conf, guint64 n)
+{
+	while (bench_writer_records(conf) < n)
+		g_usleep(50);
+}
+
+/* The line loop on a complete download, read from a file */
+static void
+bench_abfr_in(struct bench *b)
+{
+	static char	 stream[ABFR_MAX_ENTRIES * 64];
+	struct gm_conf	 conf;
+	struct abfr_dev	*d;
+	GIOChannel	*ch;
+	char		 file[32];
+	const char	*name;
+	guint64		 records;
+	size_t		 len;
+	double		 start;
+	int		 fd, j, staged;
+
+	if (!bench_group(b, "abfr_in"))
+		return;
+
+	bench_db_open(&conf, "abfr_in");
+
+	len = bench_download(stream, sizeof(stream), ABFR_MAX_ENTRIES);
+	if ((fd = open("download", O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1 ||
+	    write(fd, stream, len) != (ssize_t)len)
+		err(1, "download");
+	ch = g_io_channel_unix_new(fd);
+
+	d = abfr_init(NULL);
+	d->device.driver = &abfr_driver;
+	d->device.conf = &conf;
+	d->file = file;
+
+	for (staged = 0; staged <= 1; staged++) {
+		name = staged ? "abfr_in/staged" : "abfr_in/batch";
+		if (!bench_enabled(b, name))
+			continue;
+
+		conf.ingest_staged = staged;
+		records = bench_writer_records(&conf);
+		for (j = 0; j < b->nsamples; j++) {
+			/* Another meter every time, or its results are skipped */
+			snprintf(file, sizeof(file), "/dev/bench%d.%d", staged,
+			    j);
+			lseek(fd, 0, SEEK_SET);
+			d->protocol_state = ABFR_DEVICE_TYPE;
+			d->checksum = 0;
+			d->results_processed = 0;
+			d->inlen = 0;
+			devicemgmt_begin(&d->device);
+
+			start = bench_now();
+			while (abfr_driver.driver_input(&d->device, ch))
+				;
+			b->samples[j] = bench_now() - start;
+
+			if (d->protocol_state != ABFR_DONE)
+				errx(1, "%s: download failed", name);
+		}
+		bench_report(b, name, "line", ABFR_MAX_ENTRIES + 6);
+
+		/* Keep the writer out of the next samples */
+		bench_writer_wait(&conf,
+		    records + (guint64)b->nsamples * ABFR_MAX_ENTRIES);
+	}
+
+	g_io_channel_unref(ch);
+	close(fd);
+	free(d);
+	bench_db_close(&conf, "abfr_in");
+}
+
+/* A download's worth of readings, inserted one at a time and at once */
+static void
+bench_insert(struct bench *b)
+{
+	struct gm_conf		 conf;
+	struct meas_batch	*batch;
+	guint64			 records;
+	double			 start;
+	int			 i, j;
+
+	if (!bench_group(b, "meas_insert") &&
+	    !bench_group(b, "meas_db_apply"))
+		return;
+
+	bench_db_open(&conf, "meas_insert");
+
+	/* Through the writer, until committed */
+	if (bench_enabled(b, "meas_insert/single")) {
+		for (j = 0; j < b->nsamples; j++) {
+			records = bench_writer_records(&conf);
+			start = bench_now();
+			for (i = 0; i < ABFR_MAX_ENTRIES; i++) {
+				b->newest += BENCH_INTERVAL;
+				meas_insert(&conf, 40 + random() % 300,
+				    b->newest, "bench");
+			}
+			bench_writer_wait(&conf, records + ABFR_MAX_ENTRIES);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, "meas_insert/single", "record",
+		    ABFR_MAX_ENTRIES);
+	}
+
+	if (bench_enabled(b, "meas_insert/batched")) {
+		for (j = 0; j < b->nsamples; j++) {
+			batch = bench_batch(b, "bench", ABFR_MAX_ENTRIES);
+			records = bench_writer_records(&conf);
+			start = bench_now();
+			meas_insert_batch(&conf, batch);
+			bench_writer_wait(&conf, records + ABFR_MAX_ENTRIES);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, "meas_insert/batched", "record",
+		    ABFR_MAX_ENTRIES);
+	}
+
+	/* What a transaction per reading would cost without the writer */
+	if (bench_enabled(b, "meas_db_apply/single")) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			bench_db_fill(b, &conf, ABFR_MAX_ENTRIES, 1);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, "meas_db_apply/single", "record",
+		    ABFR_MAX_ENTRIES);
+	}
+
+	if (bench_enabled(b, "meas_db_apply/batched")) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			bench_db_fill(b, &conf, ABFR_MAX_ENTRIES,
+			    ABFR_MAX_ENTRIES);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, "meas_db_apply/batched", "record",
+		    ABFR_MAX_ENTRIES);
+	}
+
+	bench_db_close(&conf, "meas_insert");
+}
+
+/* The cache's vector kernels have to agree with the plain C one */
+static void
+bench_meascache_check(struct bench *b)
+{
+	int	 bad;
+
+	if (!bench_group(b, "meascache"))
+		return;
+
+	if ((bad = meascache_check(1)) != 0)
+		errx(1, "meascache_check: %d mismatches", bad);
+
+	fprintf(stderr, "%-32s %14s\n", "meascache_check", "ok");
+}
+
+/*
+ * Opening and refreshing the model with rows readings in the database, and
+ * statistics over all of them.
+ */
+static void
+bench_model(struct bench *b, int rows)
+{
+	static const char	*groups[] = { "meas_model", "meas_model_fill",
+	    "meascache_stats", "meas_stats" };
+	struct gm_conf		 conf;
+	struct meas_stats	 st;
+	char			 dir[32], name[64];
+	double			 start;
+	size_t			 i;
+	int			 j;
+
+	for (i = 0; i < G_N_ELEMENTS(groups); i++) {
+		snprintf(name, sizeof(name), "%s/%d", groups[i], rows);
+		if (bench_group(b, name))
+			break;
+	}
+	if (i == G_N_ELEMENTS(groups))
+		return;
+
+	snprintf(dir, sizeof(dir), "meas_model.%d", rows);
+	bench_db_open(&conf, dir);
+	bench_db_fill(b, &conf, rows, BENCH_FILL_ROWS);
+	meas_model_fill(&conf);
+
+	/* A restart, with the snapshot from the previous run */
+	snprintf(name, sizeof(name), "meas_model/%d/open", rows);
+	if (bench_enabled(b, name)) {
+		for (j = 0; j < b->nsamples; j++) {
+			bench_db_close(&conf, NULL);
+			start = bench_now();
+			bench_db_open(&conf, NULL);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, name, "call", 1);
+	}
+
+	/* The refresh button, nothing new */
+	snprintf(name, sizeof(name), "meas_model_fill/%d/idle", rows);
+	if (bench_enabled(b, name)) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			meas_model_fill(&conf);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, name, "call", 1);
+	}
+
+	/* After a download */
+	snprintf(name, sizeof(name), "meas_model_fill/%d/download", rows);
+	if (bench_enabled(b, name)) {
+		for (j = 0; j < b->nsamples; j++) {
+			bench_db_fill(b, &conf, ABFR_MAX_ENTRIES,
+			    ABFR_MAX_ENTRIES);
+			start = bench_now();
+			meas_model_fill(&conf);
+			b->samples[j] = bench_now() - start;
+		}
+		bench_report(b, name, "row", ABFR_MAX_ENTRIES);
+	}
+
+	/* Every reading so far, from the columns in memory */
+	snprintf(name, sizeof(name), "meascache_stats/%d", rows);
+	if (bench_enabled(b, name)) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			meascache_stats(conf.cache, GM_DEVICE_ALL, BENCH_START,
+			    b->newest + 1, &st);
+			b->samples[j] = bench_now() - start;
+			bench_sink += st.count;
+		}
+		bench_report(b, name, "call", 1);
+	}
+
+	/* The same from the rollups, an SQL round-trip */
+	snprintf(name, sizeof(name), "meas_stats/%d", rows);
+	if (bench_enabled(b, name)) {
+		for (j = 0; j < b->nsamples; j++) {
+			start = bench_now();
+			meas_stats(&conf, GM_DEVICE_ALL, BENCH_START,
+			    b->newest + 1, &st);
+			b->samples[j] = bench_now() - start;
+			bench_sink += st.count;
+		}
+		bench_report(b, name, "call", 1);
+	}
+
+	bench_db_close(&conf, dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench	 b;
+	char		 tmpdir[] = "/tmp/gmbench.XXXXXXXXXX";
+	const char	*errstr;
+	int		 ch;
+
+	bzero(&b, sizeof(b));
+	b.nsamples = BENCH_SAMPLES;
+	b.newest = BENCH_START;
+
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+		case 's':
+			b.nsamples = strtonum(optarg, 1, 100000, &errstr);
+			if (errstr)
+				errx(1, "samples is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	b.names = argv + optind;
+	b.nnames = argc - optind;
+
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+	g_type_init();
+#endif
+
+	if ((b.samples = calloc(b.nsamples, sizeof(*b.samples))) == NULL)
+		err(1, "calloc");
+
+	if (mkdtemp(tmpdir) == NULL || chdir(tmpdir) == -1)
+		err(1, "%s", tmpdir);
+
+	/* The rest of the program prints on stdout, only JSON goes there */
+	if ((b.json = fdopen(dup(STDOUT_FILENO), "w")) == NULL ||
+	    dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+		err(1, "stdout");
+
+	srandom(1);
+
+	fprintf(b.json, "{\n  \"samples\": %d,\n  \"benchmarks\": [", b.nsamples);
+
+	bench_scanline(&b);
+	bench_checksum(&b);
+	bench_abfr_in(&b);
+	bench_insert(&b);
+	bench_meascache_check(&b);
+	bench_model(&b, 10000);
+	bench_model(&b, 100000);
+	bench_model(&b, 1000000);
+
+	fprintf(b.json, "\n  ]\n}\n");
+
+	if (chdir("/") == -1 || rmdir(tmpdir) == -1)
+		warn("%s", tmpdir);
+
+	fclose(b.json);
+	free(b.samples);
+
+	return 0;
+}
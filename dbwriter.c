@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * All inserts are done by a separate thread which owns its own connection to
+ * the database. The main loop hands batches over through a queue and never
+ * waits for the disk; once a batch is committed the main loop is told to
+ * pick up the new rows.
+ *
+ * Batches which arrive close together, typically from several meters that
+ * finish at the same time, are committed together: after the first batch
+ * the writer keeps collecting for commit_window milliseconds or until
+ * commit_limit records are pending.
+ *
+ * With staged ingest a download arrives as a series of STAGE batches and
+ * ends with a PROMOTE or DISCARD batch; see meas_stage_begin(). When staging
+ * part of a download fails the whole download is discarded at the end.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sqlite3.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+struct dbwriter {
+	struct gm_conf		*conf;
+	struct gm_db		 db;
+	GAsyncQueue		*queue;
+	GThread			*thread;
+	gint			 notify_pending;
+	GHashTable		*broken;	/* downloads that lost a batch */
+
+	GMutex			 stats_lock;
+	struct dbwriter_stats	 stats;
+};
+
+/* Pushed by dbwriter_stop() to end the thread */
+static struct meas_batch dbwriter_quit;
+
+static gboolean
+dbwriter_notify(gpointer data)
+{
+	struct dbwriter	*writer = data;
+
+	g_atomic_int_set(&writer->notify_pending, 0);
+
+	meas_model_fill(writer->conf);
+
+	return FALSE;
+}
+
+static int
+dbwriter_commit(struct dbwriter *writer, struct meas_batch **batches, guint n)
+{
+	guint	 i;
+
+	if (meas_db_begin(&writer->db) == -1)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (meas_db_apply(&writer->db, batches[i]) == -1) {
+			meas_db_rollback(&writer->db);
+			return -1;
+		}
+	}
+
+	if (meas_db_commit(&writer->db) == -1) {
+		meas_db_rollback(&writer->db);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A download that lost a batch is discarded instead of promoted, and is
+ * forgotten once it is discarded. Returns whether the batch was turned
+ * into a discard.
+ */
+static int
+dbwriter_settle(struct dbwriter *writer, struct meas_batch *batch)
+{
+	gpointer	 download = GINT_TO_POINTER(batch->download);
+
+	if (batch->op == MEAS_BATCH_DISCARD)
+		g_hash_table_remove(writer->broken, download);
+
+	if (batch->op != MEAS_BATCH_PROMOTE ||
+	    !g_hash_table_remove(writer->broken, download))
+		return 0;
+
+	/* Half a download is worse than none */
+	batch->op = MEAS_BATCH_DISCARD;
+
+	return 1;
+}
+
+/* The readings a committed batch made visible */
+static int
+dbwriter_records(struct meas_batch *batch)
+{
+	if (batch->op == MEAS_BATCH_INSERT || batch->op == MEAS_BATCH_PROMOTE)
+		return batch->nrecords;
+
+	return 0;
+}
+
+/* Only the transactions that committed and the readings in them count */
+static void
+dbwriter_account(struct dbwriter *writer, GPtrArray *group, int commits,
+    guint64 records, int failed)
+{
+	struct meas_batch	*batch;
+	guint64			 latency;
+	gint64			 now;
+	guint			 i;
+
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(&writer->stats_lock);
+	writer->stats.groups++;
+	writer->stats.commits += commits;
+	writer->stats.records += records;
+	writer->stats.failures += failed;
+	writer->stats.batches += group->len;
+	if (group->len > writer->stats.max_batches)
+		writer->stats.max_batches = group->len;
+	for (i = 0; i < group->len; i++) {
+		batch = g_ptr_array_index(group, i);
+		metrics_observe(METRIC_INSERT_TIME, now - batch->queued);
+	}
+
+	/* The first batch waited the longest */
+	batch = g_ptr_array_index(group, 0);
+	latency = now - batch->queued;
+	writer->stats.latency_total += latency;
+	if (latency > writer->stats.latency_max)
+		writer->stats.latency_max = latency;
+	g_mutex_unlock(&writer->stats_lock);
+}
+
+static gpointer
+dbwriter_main(gpointer data)
+{
+	struct dbwriter		*writer = data;
+	struct gm_conf		*conf = writer->conf;
+	struct meas_batch	*batch;
+	GPtrArray		*group;
+	gint64			 deadline, now;
+	guint64			 committed;
+	int			 records, commits, failed, quit = 0;
+	guint			 i;
+
+	group = g_ptr_array_new();
+
+	while (!quit) {
+		batch = g_async_queue_pop(writer->queue);
+		if (batch == &dbwriter_quit)
+			break;
+
+		g_ptr_array_add(group, batch);
+		records = batch->nrecords;
+		deadline = g_get_monotonic_time() + conf->commit_window * 1000;
+
+		/* Collect whatever else arrives within the window */
+		while (records < conf->commit_limit) {
+			now = g_get_monotonic_time();
+			if (now >= deadline)
+				break;
+
+			batch = g_async_queue_timeout_pop(writer->queue,
+			    deadline - now);
+			if (batch == NULL)
+				break;
+			if (batch == &dbwriter_quit) {
+				quit = 1;
+				break;
+			}
+
+			g_ptr_array_add(group, batch);
+			records += batch->nrecords;
+		}
+
+		failed = 0;
+		for (i = 0; i < group->len; i++)
+			failed += dbwriter_settle(writer,
+			    g_ptr_array_index(group, i));
+
+		commits = 0;
+		committed = 0;
+
+		if (dbwriter_commit(writer, (struct meas_batch **)group->pdata,
+		    group->len) == -1) {
+			/*
+			 * Don't let one bad batch take the others down. A
+			 * stage failing here may break a download promoted
+			 * later in the group.
+			 */
+			for (i = 0; i < group->len; i++) {
+				batch = g_ptr_array_index(group, i);
+				failed += dbwriter_settle(writer, batch);
+				if (dbwriter_commit(writer, &batch, 1) == 0) {
+					commits++;
+					committed += dbwriter_records(batch);
+					continue;
+				}
+
+				failed++;
+				if (batch->op == MEAS_BATCH_STAGE)
+					g_hash_table_add(writer->broken,
+					    GINT_TO_POINTER(batch->download));
+				if (batch->op == MEAS_BATCH_PROMOTE) {
+					/* Don't leave it staged */
+					batch->op = MEAS_BATCH_DISCARD;
+					if (dbwriter_commit(writer, &batch, 1) == 0)
+						commits++;
+				}
+			}
+		} else {
+			commits = 1;
+			for (i = 0; i < group->len; i++)
+				committed += dbwriter_records(
+				    g_ptr_array_index(group, i));
+		}
+
+		dbwriter_account(writer, group, commits, committed, failed);
+
+		for (i = 0; i < group->len; i++)
+			meas_batch_free(g_ptr_array_index(group, i));
+		g_ptr_array_set_size(group, 0);
+
+		/* Only one refresh has to be outstanding at a time */
+		if (committed > 0 &&
+		    g_atomic_int_compare_and_exchange(&writer->notify_pending,
+		    0, 1))
+			g_idle_add(dbwriter_notify, writer);
+	}
+
+	g_ptr_array_free(group, TRUE);
+
+	return NULL;
+}
+
+struct dbwriter *
+dbwriter_start(struct gm_conf *conf, const char *path)
+{
+	struct dbwriter	*writer;
+	int		 r;
+
+	writer = g_new0(struct dbwriter, 1);
+	writer->conf = conf;
+
+	r = sqlite3_open(path, &writer->db.handle);
+	if (r != SQLITE_OK)
+		goto fail;
+
+	sqlite3_busy_timeout(writer->db.handle, GM_BUSY_TIMEOUT);
+
+	/*
+	 * The main thread put the database in WAL mode. With synchronous set
+	 * to NORMAL a commit only appends to the log; the fsync happens at
+	 * checkpoint time.
+	 */
+	sqlite3_exec(writer->db.handle, "PRAGMA synchronous = NORMAL", NULL,
+	    NULL, NULL);
+
+	if (meas_db_prepare(&writer->db) == -1)
+		goto fail;
+
+	g_mutex_init(&writer->stats_lock);
+	writer->broken = g_hash_table_new(g_direct_hash, g_direct_equal);
+	writer->queue = g_async_queue_new();
+	writer->thread = g_thread_new("dbwriter", dbwriter_main, writer);
+
+	return writer;
+fail:
+	fprintf(stderr, "dbwriter: %s\n", sqlite3_errmsg(writer->db.handle));
+	meas_db_close(&writer->db);
+	g_free(writer);
+
+	return NULL;
+}
+
+/*
+ * Hand a batch to the writer thread, which frees it when it's done.
+ */
+void
+dbwriter_submit(struct dbwriter *writer, struct meas_batch *batch)
+{
+	batch->queued = g_get_monotonic_time();
+	g_async_queue_push(writer->queue, batch);
+}
+
+void
+dbwriter_stats(struct dbwriter *writer, struct dbwriter_stats *stats)
+{
+	g_mutex_lock(&writer->stats_lock);
+	*stats = writer->stats;
+	g_mutex_unlock(&writer->stats_lock);
+}
+
+/*
+ * Wait for the queued batches to be written and stop the thread.
+ */
+void
+dbwriter_stop(struct dbwriter *writer)
+{
+	struct dbwriter_stats	*st = &writer->stats;
+
+	g_async_queue_push(writer->queue, &dbwriter_quit);
+	g_thread_join(writer->thread);
+
+	if (st->groups > 0)
+		printf("dbwriter: %llu records in %llu batches, %llu commits, "
+		    "%llu failed, avg latency %llu us, max %llu us\n",
+		    (unsigned long long)st->records,
+		    (unsigned long long)st->batches,
+		    (unsigned long long)st->commits,
+		    (unsigned long long)st->failures,
+		    (unsigned long long)(st->latency_total / st->groups),
+		    (unsigned long long)st->latency_max);
+
+	g_mutex_clear(&writer->stats_lock);
+	g_async_queue_unref(writer->queue);
+	g_hash_table_destroy(writer->broken);
+	meas_db_close(&writer->db);
+	g_free(writer);
+}
@@ -15,7 +15,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <sys/queue.h>
 
@@ -23,41 +29,650 @@
 
 #include "glucosemeter.h"
 
-void devicemgmt_final(struct device *dev);
+/* Downloads running behind one USB hub */
+struct devicemgmt_hub {
+	char		*path;		/* in sysfs */
+	int		 running;
+};
+
+static gboolean	devicemgmt_timeout(gpointer);
+static gboolean	devicemgmt_run(gpointer);
+static int	devicemgmt_unqueue(struct device *);
 
 void
 devicemgmt_init(struct gm_conf *conf)
 {
 	TAILQ_INIT(&conf->devices);
+	SLIST_INIT(&conf->listeners);
+	SLIST_INIT(&conf->patterns);
+	conf->active = 0;
+	conf->reactor_next = 0;
 	conf->devicemgmt_status = 0;
+
+	g_mutex_init(&conf->queue_lock);
+	TAILQ_INIT(&conf->queue);
+	conf->queued = conf->queued_max = conf->running = 0;
+	conf->started = conf->wait_total = conf->wait_max = 0;
+	conf->hubs = NULL;
+}
+
+/*
+ * The devices are spread over the reactor threads in the order they are
+ * configured or plugged in. If a reactor can't be started its devices are
+ * served by the main thread.
+ */
+static void
+devicemgmt_assign(struct gm_conf *conf, struct device *dev)
+{
+	if (conf->reactors == NULL)
+		return;
+
+	dev->reactor = conf->reactors[conf->reactor_next++ % conf->io_threads];
+}
+
+/*
+ * Drivers are started by the thread serving the device, so none of its
+ * callbacks can run before the driver is done starting.
+ */
+static gboolean
+devicemgmt_run(gpointer data)
+{
+	struct device	*dev = data;
+
+	TRACEPOINT(TRACE_DEVICE_START, dev, dev->retries, 0);
+
+	if (dev->driver->driver_start_fn(dev) == -1)
+		devicemgmt_done(dev, DEVICE_ERROR);
+
+	return FALSE;
+}
+
+#ifdef __linux__
+/*
+ * The hub a serial port is plugged into, from the path of its USB
+ * interface in sysfs: .../usb1/1-1/1-1.2/1-1.2:1.0/ttyUSB0 is behind hub
+ * .../usb1/1-1. Ports that aren't on USB have none.
+ */
+static char *
+devicemgmt_hub_path(const char *port)
+{
+	char	 path[PATH_MAX], link[PATH_MAX], *last;
+	int	 i;
+
+	if (realpath(port, path) == NULL)
+		return NULL;
+
+	last = strrchr(path, '/');
+	snprintf(link, sizeof(link), "/sys/class/tty/%s/device", last + 1);
+	if (realpath(link, path) == NULL)
+		return NULL;
+
+	while ((last = strrchr(path, '/')) != NULL) {
+		if (strchr(last, ':') != NULL && strchr(last, '-') != NULL)
+			break;
+		*last = '\0';
+	}
+
+	/* Up from the interface to the device, and from there to the hub */
+	for (i = 0; i < 2; i++) {
+		if ((last = strrchr(path, '/')) == NULL)
+			return NULL;
+		*last = '\0';
+	}
+
+	return g_strdup(path);
+}
+#else
+static char *
+devicemgmt_hub_path(const char *port)
+{
+	return NULL;
+}
+#endif
+
+static void
+devicemgmt_hub_free(gpointer data)
+{
+	struct devicemgmt_hub	*hub = data;
+
+	g_free(hub->path);
+	g_free(hub);
+}
+
+static struct devicemgmt_hub *
+devicemgmt_hub(struct gm_conf *conf, const char *port)
+{
+	struct devicemgmt_hub	*hub;
+	char			*path;
+
+	if (port == NULL || (path = devicemgmt_hub_path(port)) == NULL)
+		return NULL;
+
+	if (conf->hubs == NULL)
+		conf->hubs = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    NULL, devicemgmt_hub_free);
+
+	hub = g_hash_table_lookup(conf->hubs, path);
+	if (hub != NULL) {
+		g_free(path);
+		return hub;
+	}
+
+	hub = g_new0(struct devicemgmt_hub, 1);
+	hub->path = path;
+	g_hash_table_insert(conf->hubs, hub->path, hub);
+
+	return hub;
+}
+
+/*
+ * Take the first device from the queue that may start, with the queue
+ * locked. Devices behind a busy hub wait without holding up the others.
+ */
+static struct device *
+devicemgmt_next(struct gm_conf *conf)
+{
+	struct device	*dev;
+	guint64		 wait;
+
+	if (conf->download_limit > 0 && conf->running >= conf->download_limit)
+		return NULL;
+
+	TAILQ_FOREACH(dev, &conf->queue, qentry) {
+		if (dev->hub != NULL && conf->hub_limit > 0 &&
+		    dev->hub->running >= conf->hub_limit)
+			continue;
+
+		TAILQ_REMOVE(&conf->queue, dev, qentry);
+		conf->queued--;
+		conf->running++;
+		if (dev->hub != NULL)
+			dev->hub->running++;
+		dev->sched = DEVICE_RUNNING;
+
+		dev->started = g_get_monotonic_time();
+		wait = dev->started - dev->queued;
+		conf->started++;
+		conf->wait_total += wait;
+		conf->wait_max = MAX(conf->wait_max, wait);
+
+		return dev;
+	}
+
+	return NULL;
+}
+
+/* Start what may start; the lock isn't held while drivers start */
+static void
+devicemgmt_dispatch(struct gm_conf *conf)
+{
+	struct device	*dev;
+
+	for (;;) {
+		g_mutex_lock(&conf->queue_lock);
+		dev = devicemgmt_next(conf);
+		g_mutex_unlock(&conf->queue_lock);
+
+		if (dev == NULL)
+			break;
+
+		reactor_invoke(dev->reactor, devicemgmt_run, dev);
+	}
+}
+
+/*
+ * Downloads wait in a queue, so no more than conf->download_limit run at
+ * once, and no more than conf->hub_limit behind one USB hub; meters
+ * sharing a hub corrupt each other's transfers. The device whose newest
+ * stored reading is the oldest goes first, one that never synced before
+ * all others.
+ */
+static void
+devicemgmt_enqueue(struct device *dev)
+{
+	struct gm_conf	*conf = dev->conf;
+	struct device	*d;
+
+	dev->queued = g_get_monotonic_time();
+
+	g_mutex_lock(&conf->queue_lock);
+	TAILQ_FOREACH(d, &conf->queue, qentry) {
+		if (d->newest > dev->newest)
+			break;
+	}
+	if (d != NULL)
+		TAILQ_INSERT_BEFORE(d, dev, qentry);
+	else
+		TAILQ_INSERT_TAIL(&conf->queue, dev, qentry);
+	dev->sched = DEVICE_QUEUED;
+	conf->queued++;
+	conf->queued_max = MAX(conf->queued_max, conf->queued);
+	g_mutex_unlock(&conf->queue_lock);
+
+	devicemgmt_dispatch(conf);
+}
+
+/* From the main thread, it uses the main connection */
+static void
+devicemgmt_queue(struct device *dev)
+{
+	struct gm_conf	*conf = dev->conf;
+
+	dev->newest = G_MININT64;
+	if (dev->name != NULL && conf->db.handle != NULL)
+		dev->newest = meas_device_newest(&conf->db, dev->name);
+	dev->hub = devicemgmt_hub(conf, dev->name);
+
+	devicemgmt_enqueue(dev);
+}
+
+/*
+ * Start a device that finished again, from the thread serving it. It
+ * stays behind the hub it was found behind, hubs are only looked up from
+ * the main thread.
+ */
+static void
+devicemgmt_restart(struct device *dev)
+{
+	struct gm_db	*db = devicemgmt_db(dev);
+
+	devicemgmt_begin(dev);
+
+	dev->newest = G_MININT64;
+	if (dev->name != NULL && db->handle != NULL)
+		dev->newest = meas_device_newest(db, dev->name);
+
+	devicemgmt_enqueue(dev);
+}
+
+/*
+ * Take a device out of the queue, or give up its place among the running.
+ * Returns whether another one may start now.
+ */
+static int
+devicemgmt_unqueue(struct device *dev)
+{
+	struct gm_conf	*conf = dev->conf;
+	int		 running;
+
+	g_mutex_lock(&conf->queue_lock);
+	running = dev->sched == DEVICE_RUNNING;
+	if (dev->sched == DEVICE_QUEUED) {
+		TAILQ_REMOVE(&conf->queue, dev, qentry);
+		conf->queued--;
+	} else if (running) {
+		conf->running--;
+		if (dev->hub != NULL)
+			dev->hub->running--;
+	}
+	dev->sched = DEVICE_IDLE;
+	g_mutex_unlock(&conf->queue_lock);
+
+	return running;
+}
+
+void
+devicemgmt_stats(struct gm_conf *conf, struct devicemgmt_stats *st)
+{
+	g_mutex_lock(&conf->queue_lock);
+	st->queued = conf->queued;
+	st->queued_max = conf->queued_max;
+	st->running = conf->running;
+	st->started = conf->started;
+	st->wait_total = conf->wait_total;
+	st->wait_max = conf->wait_max;
+	g_mutex_unlock(&conf->queue_lock);
 }
 
 void
 devicemgmt_start(struct gm_conf *conf)
 {
 	struct device *dev;
-	struct driver *driver;
+	int i;
+
+	if (conf->io_threads > 0) {
+		conf->reactors = g_new0(struct reactor *, conf->io_threads);
+		for (i = 0; i < conf->io_threads; i++)
+			conf->reactors[i] = reactor_start(GM_DATABASE_FILE, i);
+	}
 
+	/* All are counted first, so a failing start isn't taken for the last */
 	TAILQ_FOREACH(dev, &conf->devices, entry) {
-		driver = dev->driver;
+		devicemgmt_assign(conf, dev);
+		devicemgmt_begin(dev);
+	}
+
+	TAILQ_FOREACH(dev, &conf->devices, entry)
+		devicemgmt_queue(dev);
+}
+
+/*
+ * Start a device that showed up after devicemgmt_start(), from the main
+ * thread. The device is the caller's until it is added.
+ */
+void
+devicemgmt_add(struct gm_conf *conf, struct device *dev)
+{
+	dev->conf = conf;
+	TAILQ_INSERT_TAIL(&conf->devices, dev, entry);
+
+	devicemgmt_assign(conf, dev);
+	devicemgmt_begin(dev);
+
+	devicemgmt_queue(dev);
+}
+
+static gboolean
+devicemgmt_reap(gpointer data)
+{
+	struct device	*dev = data;
+
+	/* It mustn't start again on its way out */
+	dev->reopen = 0;
+	devicemgmt_done(dev, DEVICE_ERROR);
+	dev->driver->driver_free_fn(dev);
+
+	return FALSE;
+}
+
+/*
+ * Forget a device that went away, from the main thread. It is finished
+ * and freed by the thread serving it, in between its callbacks; one that
+ * is still downloading ends with an error.
+ */
+void
+devicemgmt_remove(struct device *dev)
+{
+	TAILQ_REMOVE(&dev->conf->devices, dev, entry);
+
+	/* It mustn't be started after it's gone, nor keep a place */
+	if (devicemgmt_unqueue(dev))
+		devicemgmt_dispatch(dev->conf);
+
+	reactor_invoke(dev->reactor, devicemgmt_reap, dev);
+}
+
+static gboolean
+devicemgmt_retry(gpointer data)
+{
+	struct device	*dev = data;
+
+	if (dev->is_processing)
+		dev->reopen = 1;
+	else if (dev->status == DEVICE_ERROR)
+		devicemgmt_restart(dev);
+
+	return FALSE;
+}
 
-		driver->driver_start_fn((struct device *)dev);
+/*
+ * Try a device that ended with an error again, from the main thread. Its
+ * state is only looked at by the thread serving it; one that is still
+ * starting or running is tried again if it ends with an error too.
+ */
+void
+devicemgmt_reopen(struct device *dev)
+{
+	reactor_invoke(dev->reactor, devicemgmt_retry, dev);
+}
+
+struct device *
+devicemgmt_find(struct gm_conf *conf, const char *name)
+{
+	struct device *dev;
+
+	TAILQ_FOREACH(dev, &conf->devices, entry) {
+		if (dev->name != NULL && strcmp(dev->name, name) == 0)
+			return dev;
 	}
+
+	return NULL;
+}
+
+/*
+ * The listener has to stay around until devicemgmt_stop(). Callbacks run
+ * where the device's events are handled.
+ */
+void
+devicemgmt_listen(struct gm_conf *conf, struct devicemgmt_listener *l)
+{
+	SLIST_INSERT_HEAD(&conf->listeners, l, entry);
 }
 
 void
-devicemgmt_final(struct device *dev)
+devicemgmt_begin(struct device *dev)
 {
-	struct device	*idev;
+	if (dev->is_processing)
+		return;
+
+	dev->is_processing = 1;
+	dev->retries = 0;
+	g_atomic_int_inc(&dev->conf->active);
+
+	TRACEPOINT_DEVICE(dev);
+}
+
+static void
+devicemgmt_unwatch(GSource **source)
+{
+	if (*source == NULL)
+		return;
+
+	/* Safe when GLib already destroyed it, we hold a reference */
+	g_source_destroy(*source);
+	g_source_unref(*source);
+	*source = NULL;
+}
+
+/*
+ * Drivers call this once a device is finished, however that came about.
+ * The driver is stopped, which closes the port. Only the devices still
+ * processing are counted, so this doesn't depend on the number of devices.
+ */
+void
+devicemgmt_done(struct device *dev, enum device_status status)
+{
+	struct gm_conf			*conf = dev->conf;
+	struct devicemgmt_listener	*l;
+
+	if (!dev->is_processing)
+		return;
+
+	dev->is_processing = 0;
+	dev->status = status;
+	TRACEPOINT(TRACE_DEVICE_DONE, dev, status, 0);
+
+	devicemgmt_unwatch(&dev->timer);
+	dev->deadline = 0;
+	dev->retrying = 0;
+
+	metrics_count(METRIC_DOWNLOADS + status, 1);
+	if (status == DEVICE_DONE && dev->started != 0)
+		metrics_observe(METRIC_DOWNLOAD_TIME,
+		    g_get_monotonic_time() - dev->started);
+
+	dev->driver->driver_stop_fn(dev);
+
+	if (devicemgmt_unqueue(dev))
+		devicemgmt_dispatch(conf);
+
+	SLIST_FOREACH(l, &conf->listeners, entry) {
+		if (l->device_done != NULL)
+			l->device_done(dev, status, l->arg);
+	}
+
+	/* Before it's no longer counted, so the others aren't taken for done */
+	if (dev->reopen) {
+		dev->reopen = 0;
+		if (status == DEVICE_ERROR)
+			devicemgmt_restart(dev);
+	}
+
+	if (!g_atomic_int_dec_and_test(&conf->active))
+		return;
+
+	SLIST_FOREACH(l, &conf->listeners, entry) {
+		if (l->all_done != NULL)
+			l->all_done(conf, l->arg);
+	}
+}
+
+int
+devicemgmt_active(struct gm_conf *conf)
+{
+	return g_atomic_int_get(&conf->active);
+}
+
+/*
+ * Serve an opened port from the thread the device was given. Input and
+ * errors are always watched; output only while there is some queued, see
+ * devicemgmt_write().
+ */
+int
+devicemgmt_open(struct device *dev, int fd)
+{
+	dev->channel = g_io_channel_unix_new(fd);
+	if (dev->channel == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	dev->outq = g_byte_array_new();
+
+	/* A hangup shows up as the end of the input */
+	dev->in_source = reactor_watch(dev->reactor, dev->channel,
+	    G_IO_IN | G_IO_HUP, devicemgmt_input, dev);
+	dev->err_source = reactor_watch(dev->reactor, dev->channel,
+	    G_IO_ERR | G_IO_NVAL, devicemgmt_error, dev);
+
+	return 0;
+}
+
+/*
+ * Queue bytes for the device. Writing starts once the port can take them,
+ * and the driver's output function is called when all is sent. Only the
+ * thread serving the device writes to it.
+ */
+void
+devicemgmt_write(struct device *dev, const void *buf, size_t len)
+{
+	if (dev->outq == NULL)
+		return;
+
+	g_byte_array_append(dev->outq, buf, len);
+
+	if (dev->out_source == NULL)
+		dev->out_source = reactor_watch(dev->reactor, dev->channel,
+		    G_IO_OUT, devicemgmt_output, dev);
+}
+
+/*
+ * Stop watching the port and close it. Drivers call this from their stop
+ * function; it may run from one of the device's own callbacks.
+ */
+void
+devicemgmt_close(struct device *dev)
+{
+	devicemgmt_unwatch(&dev->in_source);
+	devicemgmt_unwatch(&dev->err_source);
+	devicemgmt_unwatch(&dev->out_source);
+
+	if (dev->outq != NULL) {
+		g_byte_array_free(dev->outq, TRUE);
+		dev->outq = NULL;
+	}
+
+	if (dev->channel != NULL) {
+		g_io_channel_shutdown(dev->channel, FALSE, NULL);
+		g_io_channel_unref(dev->channel);
+		dev->channel = NULL;
+	}
+}
+
+/*
+ * The device times out unless the driver gives it another deadline within
+ * ms. Drivers set one whenever they start waiting on the meter. Only the
+ * thread serving the device sets them; a later deadline doesn't touch the
+ * timer, it is moved when it goes off.
+ */
+void
+devicemgmt_deadline(struct device *dev, int ms)
+{
+	gint64		 ready;
+
+	dev->deadline = g_get_monotonic_time() + (gint64)ms * 1000;
+
+	if (dev->timer == NULL)
+		dev->timer = reactor_timer(dev->reactor, devicemgmt_timeout,
+		    dev);
+
+	ready = g_source_get_ready_time(dev->timer);
+	if (ready == -1 || ready > dev->deadline)
+		g_source_set_ready_time(dev->timer, dev->deadline);
+}
+
+/*
+ * A meter that stops answering is closed and started again, after a wait
+ * that doubles every try. After conf->retry_limit tries it times out.
+ */
+static gboolean
+devicemgmt_timeout(gpointer data)
+{
+	struct device	*dev = data;
 	struct gm_conf	*conf = dev->conf;
-	int		 processing = 0;
+	int		 backoff, i;
+
+	if (dev->deadline == 0) {
+		g_source_set_ready_time(dev->timer, -1);
+		return TRUE;
+	}
+
+	if (g_get_monotonic_time() < dev->deadline) {
+		g_source_set_ready_time(dev->timer, dev->deadline);
+		return TRUE;
+	}
+
+	dev->deadline = 0;
+	g_source_set_ready_time(dev->timer, -1);
 
-	TAILQ_FOREACH(idev, &conf->devices, entry) {
-		processing += idev->is_processing;
+	if (dev->retrying) {
+		dev->retrying = 0;
+		devicemgmt_run(dev);
+		return TRUE;
 	}
-	if (!processing) {
-		printf("All done!\n");
+
+	if (dev->retries >= conf->retry_limit) {
+		/* This destroys the timer */
+		devicemgmt_done(dev, DEVICE_TIMEOUT);
+		return TRUE;
 	}
+
+	backoff = conf->retry_backoff;
+	for (i = 0; i < dev->retries && backoff < DEVICE_RETRY_MAX; i++)
+		backoff *= 2;
+	backoff = MIN(backoff, DEVICE_RETRY_MAX);
+	dev->retries++;
+	metrics_count(METRIC_RETRIES, 1);
+	TRACEPOINT(TRACE_DEVICE_TIMEOUT, dev, dev->retries, backoff);
+
+	g_warning("%s: no answer, trying again in %d ms", dev->name, backoff);
+
+	dev->driver->driver_stop_fn(dev);
+
+	dev->retrying = 1;
+	devicemgmt_deadline(dev, backoff);
+
+	return TRUE;
+}
+
+/* The database connection for the thread that serves the device */
+struct gm_db *
+devicemgmt_db(struct device *dev)
+{
+	if (dev->reactor != NULL)
+		return reactor_db(dev->reactor);
+
+	return &dev->conf->db;
 }
 
 gboolean
@@ -65,27 +680,40 @@ devicemgmt_input(GIOChannel *gio, GIOCondition condition, gpointer data)
 {
 	struct device	*dev = (struct device *)data;
 	struct driver	*drv = (struct driver *)dev->driver;
-	gboolean	 stop;
-
-	stop = drv->driver_input(dev, gio);
-
-	devicemgmt_final(dev);
 
-	return stop;
+	return drv->driver_input(dev, gio);
 }
 
+/* Write what is queued; the watch goes away as soon as it is all sent */
 gboolean
 devicemgmt_output(GIOChannel *gio, GIOCondition condition, gpointer data)
 {
 	struct device	*dev = (struct device *)data;
 	struct driver	*drv = (struct driver *)dev->driver;
-	gboolean	 stop;
+	ssize_t		 r;
 
-	stop = drv->driver_output(dev, gio);
+	r = write(g_io_channel_unix_get_fd(gio), dev->outq->data,
+	    dev->outq->len);
+	if (r == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
 
-	devicemgmt_final(dev);
+		drv->driver_error(dev, gio);
 
-	return stop;
+		return FALSE;
+	}
+
+	g_byte_array_remove_range(dev->outq, 0, r);
+	if (dev->outq->len > 0)
+		return TRUE;
+
+	/* GLib destroys the source when we return FALSE */
+	g_source_unref(dev->out_source);
+	dev->out_source = NULL;
+
+	drv->driver_output(dev, gio);
+
+	return FALSE;
 }
 
 gboolean
@@ -93,18 +721,65 @@ devicemgmt_error(GIOChannel *gio, GIOCondition condition, gpointer data)
 {
 	struct device	*dev = (struct device *)data;
 	struct driver	*drv = (struct driver *)dev->driver;
-	gboolean	 stop;
-
-	stop = drv->driver_error(dev, gio);
 
-	devicemgmt_final(dev);
-
-	return stop;
+	return drv->driver_error(dev, gio);
 }
 
+/*
+ * Stop the reactor threads and the devices. Downloads that are still
+ * running are cut off and finish with an error.
+ */
 void
 devicemgmt_stop(struct gm_conf *conf)
 {
+	struct device *dev;
+	struct devicemgmt_stats st;
+	int i;
+
+	/* After this no callbacks run, the devices are ours */
+	for (i = 0; conf->reactors != NULL && i < conf->io_threads; i++) {
+		if (conf->reactors[i] != NULL)
+			reactor_stop(conf->reactors[i]);
+	}
+
+	/* Nothing waiting may start while the others finish */
+	g_mutex_lock(&conf->queue_lock);
+	while ((dev = TAILQ_FIRST(&conf->queue)) != NULL) {
+		TAILQ_REMOVE(&conf->queue, dev, qentry);
+		dev->sched = DEVICE_IDLE;
+	}
+	conf->queued = 0;
+	g_mutex_unlock(&conf->queue_lock);
+
+	/* Their sources have to go before the contexts do */
+	TAILQ_FOREACH(dev, &conf->devices, entry) {
+		dev->reopen = 0;
+		devicemgmt_done(dev, DEVICE_ERROR);
+	}
+
+	for (i = 0; conf->reactors != NULL && i < conf->io_threads; i++) {
+		if (conf->reactors[i] != NULL)
+			reactor_free(conf->reactors[i]);
+	}
+	g_free(conf->reactors);
+	conf->reactors = NULL;
+
+	TAILQ_FOREACH(dev, &conf->devices, entry) {
+		dev->reactor = NULL;
+		dev->hub = NULL;
+	}
+	if (conf->hubs != NULL) {
+		g_hash_table_destroy(conf->hubs);
+		conf->hubs = NULL;
+	}
+
+	devicemgmt_stats(conf, &st);
+	if (st.started > 0)
+		printf("devicemgmt: %llu downloads, at most %d queued, "
+		    "avg wait %llu us, max %llu us\n",
+		    (unsigned long long)st.started, st.queued_max,
+		    (unsigned long long)(st.wait_total / st.started),
+		    (unsigned long long)st.wait_max);
 }
 
 int
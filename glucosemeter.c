@@ -16,149 +16,1344 @@
  */
 
 #include <fcntl.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <sqlite3.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/queue.h>
 
 #include <gtk/gtk.h>
+#include <gdk/gdkkeysyms.h>
 
 #include "glucosemeter.h"
 
 void			 gm_refresh(GtkToolButton *button, gpointer user);
 
-#define GM_MEAS_COL_GLUCOSE 0
-#define GM_MEAS_COL_DATE 1
-#define GM_MEAS_COL_DEVICE 2
-#define GM_MEAS_NUM_COLS 3
+#define GM_SCHEMA_VERSION	4
 
+#define GM_STR(x)		#x
+#define GM_XSTR(x)		GM_STR(x)
+
+/*
+ * Times are the meter's wall clock in seconds since the epoch, as if it were
+ * UTC. Devices are stored once and referenced by id. The unique index
+ * doubles as a covering index for per-device range scans.
+ */
+static const char gm_schema[] =
+	"CREATE TABLE devices ("
+	"    id INTEGER PRIMARY KEY,"
+	"    name TEXT NOT NULL UNIQUE);"
+	"CREATE TABLE measurements ("
+	"    id INTEGER PRIMARY KEY,"
+	"    time INTEGER NOT NULL,"
+	"    glucose INTEGER NOT NULL,"
+	"    device_id INTEGER NOT NULL REFERENCES devices (id));"
+	"CREATE UNIQUE INDEX measurements_device_time "
+	"    ON measurements (device_id, time, glucose);";
+
+/*
+ * Version 0 stored the dates as text, as written by asctime(3), like
+ * "Sun Jan 17 00:39:00 2010\n", and the devices as text. Dates SQLite
+ * reads itself are taken as they are. NULL for a date that is neither.
+ */
+#define GM_SCHEMA_V0_TIME(date)						\
+	"coalesce(strftime('%s', " date "), CASE WHEN " date " GLOB"	\
+	"    '[A-Z][a-z][a-z] [A-Z][a-z][a-z] [ 0-9][0-9]"		\
+	" [0-9][0-9]:[0-9][0-9]:[0-9][0-9] [0-9][0-9][0-9][0-9]*'"	\
+	"    THEN strftime('%s', printf('%s-%02d-%02d %s',"		\
+	"        substr(" date ", 21, 4),"				\
+	"        (instr('|Jan|Feb|Mar|Apr|May|Jun|Jul|Aug|Sep|Oct|Nov|Dec|',"\
+	"            '|' || substr(" date ", 5, 3) || '|') + 3) / 4,"	\
+	"        CAST(trim(substr(" date ", 9, 2)) AS INTEGER),"	\
+	"        substr(" date ", 12, 8))) END)"
+
+/* Convert the version 0 schema, the new tables are created in between */
+static const char gm_schema_rename_v0[] =
+	"ALTER TABLE measurements RENAME TO measurements_v0;";
+
+static const char gm_schema_migrate_v0[] =
+	"INSERT OR IGNORE INTO devices (name)"
+	"    SELECT DISTINCT coalesce(device, '') FROM measurements_v0;"
+	"INSERT OR IGNORE INTO measurements (time, glucose, device_id)"
+	"    SELECT CAST(" GM_SCHEMA_V0_TIME("o.date") " AS INTEGER),"
+	"    o.glucose, d.id"
+	"    FROM measurements_v0 o JOIN devices d"
+	"        ON d.name = coalesce(o.device, '')"
+	"    WHERE " GM_SCHEMA_V0_TIME("o.date") " IS NOT NULL"
+	"    ORDER BY o.rowid;";
+
+/* The old rows that didn't make it, the old table is kept unless 0 */
+static const char gm_schema_check_v0[] =
+	"SELECT count(*) FROM measurements_v0 o WHERE NOT EXISTS ("
+	"    SELECT 1 FROM measurements m JOIN devices d ON d.id = m.device_id"
+	"    WHERE d.name = coalesce(o.device, '') AND m.glucose = o.glucose"
+	"    AND m.time = CAST(" GM_SCHEMA_V0_TIME("o.date") " AS INTEGER))";
+
+/* Aggregates kept for every bucket, from the rows of measurements */
+#define GM_ROLLUP_AGGREGATES						\
+	"count(*), sum(glucose), sum(glucose * glucose),"		\
+	" min(glucose), max(glucose),"					\
+	" sum(glucose < " GM_XSTR(GM_RANGE_LOW) "),"			\
+	" sum(glucose BETWEEN " GM_XSTR(GM_RANGE_LOW) " AND "		\
+	    GM_XSTR(GM_RANGE_HIGH) "),"					\
+	" sum(glucose > " GM_XSTR(GM_RANGE_HIGH) ")"
+
+#define GM_ROLLUP_TABLE(name)						\
+	"CREATE TABLE " name " ("					\
+	"    device_id INTEGER NOT NULL,"				\
+	"    bucket INTEGER NOT NULL,"					\
+	"    count INTEGER NOT NULL DEFAULT 0,"				\
+	"    sum INTEGER NOT NULL DEFAULT 0,"				\
+	"    sumsq INTEGER NOT NULL DEFAULT 0,"				\
+	"    min INTEGER,"						\
+	"    max INTEGER,"						\
+	"    below INTEGER NOT NULL DEFAULT 0,"				\
+	"    inrange INTEGER NOT NULL DEFAULT 0,"			\
+	"    above INTEGER NOT NULL DEFAULT 0,"				\
+	"    PRIMARY KEY (device_id, bucket));"
+
+/*
+ * Version 2 adds hourly and daily rollups, per device and for all devices
+ * together under device_id 0 (GM_DEVICE_ALL). Buckets are the time divided
+ * by the bucket length.
+ */
+static const char gm_schema_v2[] =
+	"CREATE INDEX measurements_time ON measurements (time, glucose);"
+	GM_ROLLUP_TABLE("rollup_hourly")
+	GM_ROLLUP_TABLE("rollup_daily")
+	"INSERT INTO rollup_hourly SELECT device_id, time / 3600, "
+	    GM_ROLLUP_AGGREGATES " FROM measurements GROUP BY 1, 2;"
+	"INSERT INTO rollup_hourly SELECT 0, time / 3600, "
+	    GM_ROLLUP_AGGREGATES " FROM measurements GROUP BY 2;"
+	"INSERT INTO rollup_daily SELECT device_id, time / 86400, "
+	    GM_ROLLUP_AGGREGATES " FROM measurements GROUP BY 1, 2;"
+	"INSERT INTO rollup_daily SELECT 0, time / 86400, "
+	    GM_ROLLUP_AGGREGATES " FROM measurements GROUP BY 2;";
+
+/* The newest reading stored per meter, see meas_meter_mark() */
+static const char gm_schema_v3[] =
+	"CREATE TABLE meters ("
+	"    name TEXT PRIMARY KEY,"
+	"    newest INTEGER NOT NULL);";
+
+/*
+ * Version 4 counts the readings changed or deleted once stored, in the
+ * transaction that does it, also when that is done outside the program.
+ * A snapshot of another generation is stale, see meascache_open().
+ */
+static const char gm_schema_v4[] =
+	"CREATE TABLE generation (n INTEGER NOT NULL);"
+	"INSERT INTO generation VALUES (0);"
+	"CREATE TRIGGER measurements_delete AFTER DELETE ON measurements"
+	"    BEGIN UPDATE generation SET n = n + 1; END;"
+	"CREATE TRIGGER measurements_update AFTER UPDATE ON measurements"
+	"    BEGIN UPDATE generation SET n = n + 1; END;";
+
+#define GM_ROLLUP_ADD(name)						\
+	"UPDATE " name " SET count = count + ?3, sum = sum + ?4,"	\
+	"    sumsq = sumsq + ?5, min = min(coalesce(min, ?6), ?6),"	\
+	"    max = max(coalesce(max, ?7), ?7), below = below + ?8,"	\
+	"    inrange = inrange + ?9, above = above + ?10"		\
+	"    WHERE device_id = ?1 AND bucket = ?2"
+
+/* Sums the rollups of full days and of the hours around them */
+#define GM_ROLLUP_COLUMNS						\
+	"count, sum, sumsq, min, max, below, inrange, above"
+
+/* Keep in the same order as enum gm_stmt */
+static const char *gm_stmt_sql[GM_STMT_MAX] = {
+	"BEGIN",
+	"COMMIT",
+	"ROLLBACK",
+	"INSERT OR IGNORE INTO measurements (time, glucose, device_id) "
+	    "VALUES (?, ?, ?)",
+	"INSERT OR IGNORE INTO devices (name) VALUES (?)",
+	"SELECT id FROM devices WHERE name = ?",
+	"SELECT count(*), max(rowid) FROM measurements WHERE rowid > ?",
+	"SELECT m.rowid, m.glucose, m.time, d.name FROM measurements m "
+	    "JOIN devices d ON d.id = m.device_id "
+	    "WHERE m.rowid > ? ORDER BY m.rowid LIMIT ?",
+	"SELECT rowid FROM measurements WHERE rowid > ? "
+	    "ORDER BY rowid LIMIT 1 OFFSET ?",
+	"SELECT count(*) FROM measurements WHERE rowid < ?",
+	"DELETE FROM measurements WHERE rowid = ?",
+	"UPDATE measurements SET glucose = ? WHERE rowid = ?",
+	"SELECT device_id, time, glucose FROM measurements WHERE rowid = ?",
+	"INSERT OR IGNORE INTO rollup_hourly (device_id, bucket) VALUES (?, ?)",
+	GM_ROLLUP_ADD("rollup_hourly"),
+	"INSERT OR IGNORE INTO rollup_daily (device_id, bucket) VALUES (?, ?)",
+	GM_ROLLUP_ADD("rollup_daily"),
+	"SELECT sum(count), sum(sum), sum(sumsq), min(min), max(max),"
+	"    sum(below), sum(inrange), sum(above) FROM ("
+	"    SELECT " GM_ROLLUP_COLUMNS " FROM rollup_daily"
+	"        WHERE device_id = ?1 AND bucket >= ?2 AND bucket < ?3"
+	"    UNION ALL"
+	"    SELECT " GM_ROLLUP_COLUMNS " FROM rollup_hourly"
+	"        WHERE device_id = ?1 AND bucket >= ?4 AND bucket < ?5"
+	"    UNION ALL"
+	"    SELECT " GM_ROLLUP_COLUMNS " FROM rollup_hourly"
+	"        WHERE device_id = ?1 AND bucket >= ?6 AND bucket < ?7)",
+	"SELECT rowid, time, glucose, device_id FROM measurements "
+	    "WHERE rowid > ? ORDER BY rowid",
+	"SELECT ifnull(max(rowid), 0) FROM measurements",
+	"INSERT INTO staging (download, time, glucose) SELECT ?1, ?2, ?3 "
+	    "WHERE NOT EXISTS (SELECT 1 FROM measurements "
+	    "WHERE device_id = ?4 AND time = ?2 AND glucose = ?3)",
+	"SELECT time, glucose FROM staging WHERE download = ? ORDER BY time",
+	"DELETE FROM staging WHERE download = ?",
+	"INSERT OR IGNORE INTO meters (name, newest) VALUES (?1, ?2)",
+	"UPDATE meters SET newest = max(newest, ?2) WHERE name = ?1",
+	"SELECT newest FROM meters WHERE name = ?",
+	"SELECT max(time) FROM measurements "
+	    "WHERE device_id = (SELECT id FROM devices WHERE name = ?)",
+	"SELECT 1 FROM measurements "
+	    "WHERE device_id = (SELECT id FROM devices WHERE name = ?1) "
+	    "AND time = ?2 AND glucose = ?3",
+	"SELECT n FROM generation",
+};
+
+/* Per connection, so only the writer's ever holds rows */
+static const char gm_staging[] =
+	"CREATE TEMP TABLE IF NOT EXISTS staging ("
+	"    download INTEGER NOT NULL,"
+	"    time INTEGER NOT NULL,"
+	"    glucose INTEGER NOT NULL);"
+	"CREATE INDEX IF NOT EXISTS temp.staging_download"
+	"    ON staging (download, time);";
+
+/*
+ * Prepare every statement on a connection once. Each connection, the one of
+ * the main thread and the one of the writer thread, has its own set.
+ */
 int
-meas_insert(struct gm_conf *conf, int glucose, char *date, char *device)
+meas_db_prepare(struct gm_db *db)
 {
-	int		 r;
-	sqlite3_stmt    *stmt;
-	const char      *sql_tail;
+	int	 i, r;
+
+	if (sqlite3_exec(db->handle, gm_staging, NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "staging: %s\n", sqlite3_errmsg(db->handle));
+		return -1;
+	}
+
+	for (i = 0; i < GM_STMT_MAX; i++) {
+		r = sqlite3_prepare_v2(db->handle, gm_stmt_sql[i], -1,
+		    &db->stmts[i], NULL);
+		if (r != SQLITE_OK) {
+			fprintf(stderr, "prepare \"%s\": %s\n", gm_stmt_sql[i],
+			    sqlite3_errmsg(db->handle));
+			return -1;
+		}
+	}
+
+	db->device_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, g_free);
+
+	return 0;
+}
+
+/*
+ * Return a cached statement, ready to be bound and stepped.
+ */
+sqlite3_stmt *
+meas_stmt(struct gm_db *db, enum gm_stmt which)
+{
+	sqlite3_stmt	*stmt = db->stmts[which];
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return stmt;
+}
+
+static int
+meas_exec(struct gm_db *db, enum gm_stmt which)
+{
+	if (sqlite3_step(meas_stmt(db, which)) != SQLITE_DONE)
+		return -1;
+
+	return 0;
+}
+
+void
+meas_db_close(struct gm_db *db)
+{
+	int	 i;
+
+	for (i = 0; i < GM_STMT_MAX; i++) {
+		sqlite3_finalize(db->stmts[i]);
+		db->stmts[i] = NULL;
+	}
+
+	if (db->device_ids != NULL) {
+		g_hash_table_destroy(db->device_ids);
+		db->device_ids = NULL;
+	}
+
+	sqlite3_close(db->handle);
+	db->handle = NULL;
+}
+
+void
+meas_close(struct gm_conf *conf)
+{
+	if (conf->writer != NULL) {
+		dbwriter_stop(conf->writer);
+		conf->writer = NULL;
+	}
+
+	if (conf->cache != NULL) {
+		/* Pick up the last commits so the next start has them */
+		meascache_sync(conf->cache, &conf->db);
+		meascache_save(conf->cache, 0);
+		meascache_free(conf->cache);
+		conf->cache = NULL;
+	}
+
+	meas_db_close(&conf->db);
+}
+
+static int
+meas_schema_version(sqlite3 *handle)
+{
+	sqlite3_stmt	*stmt;
+	int		 version = -1;
+
+	if (sqlite3_prepare_v2(handle, "PRAGMA user_version", -1,
+	    &stmt, NULL) != SQLITE_OK)
+		return -1;
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return version;
+}
+
+static int
+meas_table_exists(sqlite3 *handle, const char *name)
+{
+	sqlite3_stmt	*stmt;
+	int		 exists;
+
+	if (sqlite3_prepare_v2(handle, "SELECT 1 FROM sqlite_master "
+	    "WHERE type = 'table' AND name = ?", -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	exists = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+
+	return exists;
+}
+
+/*
+ * Returns whether readings of version 0 would be lost. Each of them has
+ * to be in the new table before the old one is dropped.
+ */
+static int
+meas_schema_check_v0(sqlite3 *handle)
+{
+	sqlite3_stmt	*stmt;
+	int		 lost = -1;
+
+	if (sqlite3_prepare_v2(handle, gm_schema_check_v0, -1, &stmt,
+	    NULL) != SQLITE_OK) {
+		fprintf(stderr, "schema: %s\n", sqlite3_errmsg(handle));
+		return 1;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		lost = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (lost == 0)
+		return 0;
+
+	if (lost > 0)
+		fprintf(stderr, "schema: %d readings couldn't be converted, "
+		    "the database is left as it was\n", lost);
+	else
+		fprintf(stderr, "schema: %s\n", sqlite3_errmsg(handle));
+
+	return 1;
+}
+
+/*
+ * Create the tables, or bring an existing database up to date.
+ */
+static int
+meas_schema(sqlite3 *handle)
+{
+	char		*sql, *errmsg;
+	int		 version, exists, r;
+
+	version = meas_schema_version(handle);
+	if (version == -1)
+		return -1;
+	if (version == GM_SCHEMA_VERSION)
+		return 0;
+	if (version > GM_SCHEMA_VERSION) {
+		fprintf(stderr, "database schema %d is newer than %d\n",
+		    version, GM_SCHEMA_VERSION);
+		return -1;
+	}
+
+	r = sqlite3_exec(handle, "BEGIN", NULL, NULL, &errmsg);
+
+	exists = 0;
+	if (r == SQLITE_OK && version < 1) {
+		exists = meas_table_exists(handle, "measurements");
+		if (exists == -1) {
+			sqlite3_exec(handle, "ROLLBACK", NULL, NULL, NULL);
+			return -1;
+		}
+		if (exists)
+			r = sqlite3_exec(handle, gm_schema_rename_v0, NULL,
+			    NULL, &errmsg);
+		if (r == SQLITE_OK)
+			r = sqlite3_exec(handle, gm_schema, NULL, NULL,
+			    &errmsg);
+		if (r == SQLITE_OK && exists)
+			r = sqlite3_exec(handle, gm_schema_migrate_v0, NULL,
+			    NULL, &errmsg);
+		if (r == SQLITE_OK && exists && meas_schema_check_v0(handle))
+			goto fail;
+		if (r == SQLITE_OK && exists)
+			r = sqlite3_exec(handle, "DROP TABLE measurements_v0",
+			    NULL, NULL, &errmsg);
+	}
+
+	if (r == SQLITE_OK && version < 2)
+		r = sqlite3_exec(handle, gm_schema_v2, NULL, NULL, &errmsg);
+
+	if (r == SQLITE_OK && version < 3)
+		r = sqlite3_exec(handle, gm_schema_v3, NULL, NULL, &errmsg);
+
+	if (r == SQLITE_OK && version < 4)
+		r = sqlite3_exec(handle, gm_schema_v4, NULL, NULL, &errmsg);
+
+	sql = g_strdup_printf("PRAGMA user_version = %d", GM_SCHEMA_VERSION);
+	if (r == SQLITE_OK)
+		r = sqlite3_exec(handle, sql, NULL, NULL, &errmsg);
+	if (r == SQLITE_OK)
+		r = sqlite3_exec(handle, "COMMIT", NULL, NULL,
+		    &errmsg);
+	g_free(sql);
 
-	r = sqlite3_prepare_v2(conf->sqlite3_handle, "INSERT OR IGNORE INTO measurements VALUES " \
-		" (?, ?, ?);", -1, &stmt, &sql_tail);
 	if (r != SQLITE_OK) {
+		fprintf(stderr, "schema: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		goto fail;
+	}
+
+	/* Give the space of the old table back */
+	if (exists > 0)
+		sqlite3_exec(handle, "VACUUM", NULL, NULL, NULL);
+
+	return 0;
+
+fail:
+	/* The old table and user_version 0 are left as they were */
+	sqlite3_exec(handle, "ROLLBACK", NULL, NULL, NULL);
+
+	return -1;
+}
+
+/*
+ * Return the id of a device, adding it to the devices table when it is
+ * new. Ids are cached so this normally doesn't touch the database.
+ */
+static sqlite3_int64
+meas_device_id(struct gm_db *db, const char *device)
+{
+	sqlite3_stmt	*stmt;
+	sqlite3_int64	*id;
+
+	id = g_hash_table_lookup(db->device_ids, device);
+	if (id != NULL)
+		return *id;
+
+	stmt = meas_stmt(db, GM_STMT_DEVICE_INSERT);
+	sqlite3_bind_text(stmt, 1, device, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return -1;
+
+	stmt = meas_stmt(db, GM_STMT_DEVICE_ID);
+	sqlite3_bind_text(stmt, 1, device, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) != SQLITE_ROW)
+		return -1;
+
+	id = g_new(sqlite3_int64, 1);
+	*id = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	g_hash_table_insert(db->device_ids, g_strdup(device), id);
+
+	return *id;
+}
+
+struct meas_batch *
+meas_batch_new(const char *device, int nrecords)
+{
+	struct meas_batch	*batch;
+
+	batch = g_malloc(sizeof(*batch) +
+	    nrecords * sizeof(batch->records[0]));
+	batch->device = g_strdup(device);
+	batch->op = MEAS_BATCH_INSERT;
+	batch->download = 0;
+	batch->meter = NULL;
+	batch->size = nrecords;
+	batch->nrecords = 0;
+
+	return batch;
+}
+
+void
+meas_batch_free(struct meas_batch *batch)
+{
+	g_free(batch->device);
+	g_free(batch->meter);
+	g_free(batch);
+}
+
+int
+meas_db_begin(struct gm_db *db)
+{
+	return meas_exec(db, GM_STMT_BEGIN);
+}
+
+int
+meas_db_commit(struct gm_db *db)
+{
+	return meas_exec(db, GM_STMT_COMMIT);
+}
+
+void
+meas_db_rollback(struct gm_db *db)
+{
+	meas_exec(db, GM_STMT_ROLLBACK);
+
+	/* Cached ids may belong to rows which were rolled back */
+	g_hash_table_remove_all(db->device_ids);
+}
+
+/* Running totals of one bucket */
+struct meas_rollup {
+	gint64		 bucket;
+	gint64		 count;
+	gint64		 sum;
+	gint64		 sumsq;
+	int		 min;
+	int		 max;
+	gint64		 below;
+	gint64		 inrange;
+	gint64		 above;
+};
+
+static void
+meas_rollup_add(struct meas_rollup *ru, int glucose)
+{
+	if (ru->count == 0 || glucose < ru->min)
+		ru->min = glucose;
+	if (ru->count == 0 || glucose > ru->max)
+		ru->max = glucose;
+
+	ru->count++;
+	ru->sum += glucose;
+	ru->sumsq += (gint64)glucose * glucose;
+
+	if (glucose < GM_RANGE_LOW)
+		ru->below++;
+	else if (glucose > GM_RANGE_HIGH)
+		ru->above++;
+	else
+		ru->inrange++;
+}
+
+static int
+meas_rollup_store(struct gm_db *db, enum gm_stmt init, enum gm_stmt add,
+    sqlite3_int64 device_id, struct meas_rollup *ru)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = meas_stmt(db, init);
+	sqlite3_bind_int64(stmt, 1, device_id);
+	sqlite3_bind_int64(stmt, 2, ru->bucket);
+	if (sqlite3_step(stmt) != SQLITE_DONE)
 		return -1;
+
+	stmt = meas_stmt(db, add);
+	sqlite3_bind_int64(stmt, 1, device_id);
+	sqlite3_bind_int64(stmt, 2, ru->bucket);
+	sqlite3_bind_int64(stmt, 3, ru->count);
+	sqlite3_bind_int64(stmt, 4, ru->sum);
+	sqlite3_bind_int64(stmt, 5, ru->sumsq);
+	sqlite3_bind_int(stmt, 6, ru->min);
+	sqlite3_bind_int(stmt, 7, ru->max);
+	sqlite3_bind_int64(stmt, 8, ru->below);
+	sqlite3_bind_int64(stmt, 9, ru->inrange);
+	sqlite3_bind_int64(stmt, 10, ru->above);
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Add a bucket's totals to the rollups of the device and of all devices,
+ * and start a new bucket.
+ */
+static int
+meas_rollup_flush(struct gm_db *db, enum gm_stmt init, enum gm_stmt add,
+    sqlite3_int64 device_id, struct meas_rollup *ru, gint64 bucket)
+{
+	int	 r = 0;
+
+	if (ru->count > 0) {
+		if (meas_rollup_store(db, init, add, device_id, ru) == -1 ||
+		    meas_rollup_store(db, init, add, GM_DEVICE_ALL, ru) == -1)
+			r = -1;
+	}
+
+	bzero(ru, sizeof(*ru));
+	ru->bucket = bucket;
+
+	return r;
+}
+
+/*
+ * Recompute the buckets containing time from the measurements themselves.
+ * Used when a row is deleted or changed, where running totals can't be
+ * undone.
+ */
+static int
+meas_rollup_rebuild(struct gm_db *db, sqlite3_int64 device_id, gint64 time)
+{
+	static const struct {
+		const char	*table;
+		int		 width;
+	} rollups[] = {
+		{ "rollup_hourly", 3600 },
+		{ "rollup_daily", 86400 },
+	};
+	sqlite3_int64	 devices[] = { device_id, GM_DEVICE_ALL };
+	char		*sql, *where;
+	gint64		 bucket;
+	size_t		 i, j;
+	int		 r = SQLITE_OK;
+
+	for (i = 0; i < sizeof(rollups) / sizeof(rollups[0]) && r == SQLITE_OK; i++) {
+		bucket = time / rollups[i].width;
+
+		for (j = 0; j < sizeof(devices) / sizeof(devices[0]); j++) {
+			if (devices[j] == GM_DEVICE_ALL)
+				where = sqlite3_mprintf("");
+			else
+				where = sqlite3_mprintf("device_id = %lld AND ",
+				    devices[j]);
+
+			sql = sqlite3_mprintf(
+			    "DELETE FROM %s WHERE device_id = %lld AND bucket = %lld;"
+			    "INSERT INTO %s SELECT %lld, %lld, " GM_ROLLUP_AGGREGATES
+			    " FROM measurements WHERE %s time >= %lld AND time < %lld"
+			    " GROUP BY 1;",
+			    rollups[i].table, devices[j], bucket,
+			    rollups[i].table, devices[j], bucket, where,
+			    bucket * rollups[i].width,
+			    (bucket + 1) * rollups[i].width);
+
+			r = sqlite3_exec(db->handle, sql, NULL, NULL, NULL);
+			sqlite3_free(sql);
+			sqlite3_free(where);
+			if (r != SQLITE_OK)
+				break;
+		}
 	}
 
-	r = sqlite3_bind_int(stmt, 1, glucose);
-	if (r != SQLITE_OK)
+	return r == SQLITE_OK ? 0 : -1;
+}
+
+/*
+ * Insert a batch, reusing one statement for every record. This has to be
+ * called between meas_db_begin() and meas_db_commit(); it runs on the
+ * writer thread with the writer's connection.
+ */
+int
+meas_db_insert(struct gm_db *db, struct meas_batch *batch)
+{
+	sqlite3_stmt		*stmt;
+	sqlite3_int64		 device_id;
+	struct meas_record	*rec;
+	struct meas_rollup	 hour, day;
+	int			 i;
+
+	device_id = meas_device_id(db, batch->device);
+	if (device_id == -1)
 		goto fail;
 
-	r = sqlite3_bind_text(stmt, 2, date, -1, NULL);
-	if (r != SQLITE_OK)
+	bzero(&hour, sizeof(hour));
+	bzero(&day, sizeof(day));
+
+	for (i = 0; i < batch->nrecords; i++) {
+		rec = &batch->records[i];
+
+		/*
+		 * A bucket's rollup is written when the next reading falls in
+		 * another one. Readings of one bucket are next to each other
+		 * whether they come newest or oldest first, so that is once
+		 * per bucket; any order is still correct, only slower.
+		 */
+		if (rec->time / 3600 != hour.bucket &&
+		    meas_rollup_flush(db, GM_STMT_ROLLUP_HOUR_INIT,
+		    GM_STMT_ROLLUP_HOUR_ADD, device_id, &hour,
+		    rec->time / 3600) == -1)
+			goto fail;
+
+		if (rec->time / 86400 != day.bucket &&
+		    meas_rollup_flush(db, GM_STMT_ROLLUP_DAY_INIT,
+		    GM_STMT_ROLLUP_DAY_ADD, device_id, &day,
+		    rec->time / 86400) == -1)
+			goto fail;
+
+		stmt = meas_stmt(db, GM_STMT_INSERT);
+
+		if (sqlite3_bind_int64(stmt, 1, rec->time) != SQLITE_OK)
+			goto fail;
+
+		if (sqlite3_bind_int(stmt, 2, rec->glucose) != SQLITE_OK)
+			goto fail;
+
+		if (sqlite3_bind_int64(stmt, 3, device_id) != SQLITE_OK)
+			goto fail;
+
+		if (sqlite3_step(stmt) != SQLITE_DONE)
+			goto fail;
+
+		/* Readings we already had are ignored and not counted */
+		if (sqlite3_changes(db->handle) > 0) {
+			meas_rollup_add(&hour, rec->glucose);
+			meas_rollup_add(&day, rec->glucose);
+		}
+	}
+
+	if (meas_rollup_flush(db, GM_STMT_ROLLUP_HOUR_INIT,
+	    GM_STMT_ROLLUP_HOUR_ADD, device_id, &hour, 0) == -1)
 		goto fail;
 
-	r = sqlite3_bind_text(stmt, 3, device, -1, NULL);
-	if (r != SQLITE_OK)
+	if (meas_rollup_flush(db, GM_STMT_ROLLUP_DAY_INIT,
+	    GM_STMT_ROLLUP_DAY_ADD, device_id, &day, 0) == -1)
 		goto fail;
 
-	r = sqlite3_step(stmt);
-	if (r != SQLITE_DONE)
+	return 0;
+fail:
+	fprintf(stderr, "insert: %s\n", sqlite3_errmsg(db->handle));
+
+	return -1;
+}
+
+/* Hold the records of a download back until it checks out */
+static int
+meas_db_stage(struct gm_db *db, struct meas_batch *batch)
+{
+	sqlite3_stmt		*stmt;
+	sqlite3_int64		 device_id;
+	struct meas_record	*rec;
+	int			 i;
+
+	device_id = meas_device_id(db, batch->device);
+	if (device_id == -1)
 		goto fail;
 
-	sqlite3_finalize(stmt);
+	for (i = 0; i < batch->nrecords; i++) {
+		rec = &batch->records[i];
 
-	meas_model_fill(conf, GTK_LIST_STORE(conf->measurements));
+		stmt = meas_stmt(db, GM_STMT_STAGE);
+		sqlite3_bind_int(stmt, 1, batch->download);
+		sqlite3_bind_int64(stmt, 2, rec->time);
+		sqlite3_bind_int(stmt, 3, rec->glucose);
+		sqlite3_bind_int64(stmt, 4, device_id);
+
+		if (sqlite3_step(stmt) != SQLITE_DONE)
+			goto fail;
+	}
 
 	return 0;
 fail:
-	sqlite3_finalize(stmt);
+	fprintf(stderr, "stage: %s\n", sqlite3_errmsg(db->handle));
 
 	return -1;
 }
 
-int
-meas_model_fill(struct gm_conf *conf, GtkListStore *store)
+/* Fill a batch with what was staged for its download, in time order */
+static int
+meas_db_staged(struct gm_db *db, struct meas_batch *batch)
 {
-	GtkTreeIter	 iter;
+	sqlite3_stmt	*stmt;
 	int		 r;
+
+	stmt = meas_stmt(db, GM_STMT_STAGED);
+	sqlite3_bind_int(stmt, 1, batch->download);
+
+	batch->nrecords = 0;
+	while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (batch->nrecords == batch->size)
+			break;
+
+		batch->records[batch->nrecords].time =
+		    sqlite3_column_int64(stmt, 0);
+		batch->records[batch->nrecords].glucose =
+		    sqlite3_column_int(stmt, 1);
+		batch->nrecords++;
+	}
+	sqlite3_reset(stmt);
+
+	return r == SQLITE_DONE ? 0 : -1;
+}
+
+/* Move the meter's mark up to the newest reading of the batch */
+static int
+meas_db_mark(struct gm_db *db, struct meas_batch *batch)
+{
 	sqlite3_stmt	*stmt;
-	const char	*sql_tail;
+	gint64		 newest;
+	int		 i;
 
-	gtk_list_store_clear(store);
+	if (batch->meter == NULL || batch->nrecords == 0)
+		return 0;
 
-	/* Fill the measurement store with entries from the database */
-	r = sqlite3_prepare_v2(conf->sqlite3_handle,
-			"SELECT glucose, date, device from measurements", -1, &stmt, &sql_tail);
-	if (r != SQLITE_OK)
-		goto fail;
+	newest = batch->records[0].time;
+	for (i = 1; i < batch->nrecords; i++)
+		if (batch->records[i].time > newest)
+			newest = batch->records[i].time;
 
-	while((r = sqlite3_step(stmt)) == SQLITE_ROW) {
-		int glucose;
-		const unsigned char *date, *device;
+	stmt = meas_stmt(db, GM_STMT_METER_INIT);
+	sqlite3_bind_text(stmt, 1, batch->meter, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, newest);
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return -1;
 
-		gtk_list_store_append(store, &iter);
+	stmt = meas_stmt(db, GM_STMT_METER_ADD);
+	sqlite3_bind_text(stmt, 1, batch->meter, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, newest);
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return -1;
 
-		glucose = sqlite3_column_int(stmt, 0);
-		gtk_list_store_set(store, &iter, GM_MEAS_COL_GLUCOSE, glucose, -1);
+	return 0;
+}
 
-		date = sqlite3_column_text(stmt, 1);
-		gtk_list_store_set(store, &iter, GM_MEAS_COL_DATE, date, -1);
+static int
+meas_db_unstage(struct gm_db *db, int download)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = meas_stmt(db, GM_STMT_UNSTAGE);
+	sqlite3_bind_int(stmt, 1, download);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Carry out a batch, as part of the caller's transaction. The meter's mark
+ * only moves together with the readings it stands for.
+ */
+int
+meas_db_apply(struct gm_db *db, struct meas_batch *batch)
+{
+	switch (batch->op) {
+	case MEAS_BATCH_INSERT:
+		if (meas_db_insert(db, batch) == -1)
+			return -1;
+		return meas_db_mark(db, batch);
+	case MEAS_BATCH_STAGE:
+		return meas_db_stage(db, batch);
+	case MEAS_BATCH_PROMOTE:
+		if (meas_db_staged(db, batch) == -1 ||
+		    meas_db_insert(db, batch) == -1 ||
+		    meas_db_mark(db, batch) == -1)
+			return -1;
+		/* FALLTHROUGH */
+	case MEAS_BATCH_DISCARD:
+		return meas_db_unstage(db, batch->download);
+	}
+
+	return -1;
+}
+
+int
+meas_insert(struct gm_conf *conf, int glucose, time_t time, char *device)
+{
+	struct meas_batch	*batch;
+
+	batch = meas_batch_new(device, 1);
+	batch->records[0].time = time;
+	batch->records[0].glucose = glucose;
+	batch->nrecords = 1;
+
+	dbwriter_submit(conf->writer, batch);
+
+	return 0;
+}
+
+/*
+ * Queue a verified download for the writer thread, which takes the batch
+ * over. It is inserted in a single transaction and the model is refreshed
+ * once it is committed.
+ */
+int
+meas_insert_batch(struct gm_conf *conf, struct meas_batch *batch)
+{
+	if (batch->nrecords == 0) {
+		meas_batch_free(batch);
+		return 0;
+	}
+
+	dbwriter_submit(conf->writer, batch);
+
+	return 0;
+}
+
+/*
+ * Staged ingest: the results of a download go to the writer while they come
+ * in and wait in a staging table on its connection, where readings the
+ * database already has are dropped straight away. Once the download checks
+ * out the rest is inserted in one transaction, otherwise it is discarded.
+ */
+int
+meas_stage_begin(struct gm_conf *conf)
+{
+	/* Downloads are read on several threads */
+	return g_atomic_int_add(&conf->downloads, 1) + 1;
+}
+
+void
+meas_stage(struct gm_conf *conf, struct meas_batch *batch, int download)
+{
+	if (batch->nrecords == 0) {
+		meas_batch_free(batch);
+		return;
+	}
+
+	batch->op = MEAS_BATCH_STAGE;
+	batch->download = download;
+	dbwriter_submit(conf->writer, batch);
+}
+
+void
+meas_stage_promote(struct gm_conf *conf, const char *device,
+    const char *meter, int download, int nrecords)
+{
+	struct meas_batch	*batch;
+
+	/* Room for everything that was staged, the writer fills it in */
+	batch = meas_batch_new(device, nrecords);
+	batch->op = MEAS_BATCH_PROMOTE;
+	batch->download = download;
+	batch->meter = g_strdup(meter);
+	dbwriter_submit(conf->writer, batch);
+}
+
+void
+meas_stage_discard(struct gm_conf *conf, const char *device, int download)
+{
+	struct meas_batch	*batch;
+
+	batch = meas_batch_new(device, 0);
+	batch->op = MEAS_BATCH_DISCARD;
+	batch->download = download;
+	dbwriter_submit(conf->writer, batch);
+}
+
+/*
+ * Make rows which were added to the database since the last call visible.
+ * The cost depends on the number of new rows, not on the size of the table.
+ */
+int
+meas_model_fill(struct gm_conf *conf)
+{
+	gint64	 start;
+
+	start = g_get_monotonic_time();
+
+	if (measmodel_append(conf->measurements) == -1)
+		return -1;
+
+	if (meascache_sync(conf->cache, &conf->db) == -1)
+		return -1;
+
+	meascache_save(conf->cache, 1);
 
-		device = sqlite3_column_text(stmt, 2);
-		gtk_list_store_set(store, &iter, GM_MEAS_COL_DEVICE, device, -1);
+	metrics_observe(METRIC_MODEL_FILL_TIME, g_get_monotonic_time() - start);
 
+	return 0;
+}
+
+/* Look up the rollup buckets a row counts in, and its place in the cache */
+static int
+meas_row_key(struct gm_db *db, gint64 rowid, sqlite3_int64 *device_id,
+    gint64 *time, int *glucose)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = meas_stmt(db, GM_STMT_ROW_KEY);
+	sqlite3_bind_int64(stmt, 1, rowid);
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return -1;
 	}
 
-	if (r != SQLITE_DONE)
+	*device_id = sqlite3_column_int64(stmt, 0);
+	*time = sqlite3_column_int64(stmt, 1);
+	*glucose = sqlite3_column_int(stmt, 2);
+	sqlite3_reset(stmt);
+
+	return 0;
+}
+
+int
+meas_delete(struct gm_conf *conf, gint64 rowid)
+{
+	sqlite3_stmt	*stmt;
+	sqlite3_int64	 device_id;
+	gint64		 time;
+	int		 index, old;
+
+	if (meas_row_key(&conf->db, rowid, &device_id, &time, &old) == -1)
+		return 0;
+
+	index = measmodel_index(conf->measurements, rowid);
+
+	if (meas_db_begin(&conf->db) == -1)
+		return -1;
+
+	stmt = meas_stmt(&conf->db, GM_STMT_DELETE);
+
+	if (sqlite3_bind_int64(stmt, 1, rowid) != SQLITE_OK)
+		goto fail;
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		goto fail;
+
+	if (meas_rollup_rebuild(&conf->db, device_id, time) == -1)
+		goto fail;
+
+	if (meas_db_commit(&conf->db) == -1)
 		goto fail;
 
+	measmodel_row_deleted(conf->measurements, index);
+	meascache_delete(conf->cache, rowid, time, device_id, old);
+
 	return 0;
 fail:
+	meas_db_rollback(&conf->db);
+
 	return -1;
 }
 
+int
+meas_update(struct gm_conf *conf, gint64 rowid, int glucose)
+{
+	sqlite3_stmt	*stmt;
+	sqlite3_int64	 device_id;
+	gint64		 time;
+	int		 old;
+
+	if (meas_row_key(&conf->db, rowid, &device_id, &time, &old) == -1)
+		return 0;
+
+	if (meas_db_begin(&conf->db) == -1)
+		return -1;
+
+	stmt = meas_stmt(&conf->db, GM_STMT_UPDATE);
+
+	if (sqlite3_bind_int(stmt, 1, glucose) != SQLITE_OK)
+		goto fail;
+
+	if (sqlite3_bind_int64(stmt, 2, rowid) != SQLITE_OK)
+		goto fail;
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		goto fail;
+
+	if (meas_rollup_rebuild(&conf->db, device_id, time) == -1)
+		goto fail;
+
+	if (meas_db_commit(&conf->db) == -1)
+		goto fail;
+
+	measmodel_row_changed(conf->measurements,
+	    measmodel_index(conf->measurements, rowid));
+	meascache_update(conf->cache, rowid, time, device_id, old, glucose);
+
+	return 0;
+fail:
+	meas_db_rollback(&conf->db);
+
+	return -1;
+}
+
+/*
+ * Statistics over [from, to) for one device, or GM_DEVICE_ALL, answered from
+ * the rollups: daily buckets for the whole days in the range and hourly ones
+ * for the hours before and after them. The range is rounded down to whole
+ * hours.
+ */
+int
+meas_stats(struct gm_conf *conf, sqlite3_int64 device_id, time_t from,
+    time_t to, struct meas_stats *st)
+{
+	sqlite3_stmt	*stmt;
+	gint64		 h0, h1, d0, d1;
+	double		 sum, sumsq;
+	int		 r;
+
+	bzero(st, sizeof(*st));
+
+	h0 = from / 3600;
+	h1 = to / 3600;
+	if (h1 <= h0)
+		return 0;
+
+	d0 = (h0 + 23) / 24;
+	d1 = h1 / 24;
+	if (d1 <= d0)
+		d0 = d1 = h1 / 24;
+
+	stmt = meas_stmt(&conf->db, GM_STMT_STATS);
+	sqlite3_bind_int64(stmt, 1, device_id);
+	sqlite3_bind_int64(stmt, 2, d0);
+	sqlite3_bind_int64(stmt, 3, d1);
+	if (d0 == d1) {
+		sqlite3_bind_int64(stmt, 4, h0);
+		sqlite3_bind_int64(stmt, 5, h1);
+		sqlite3_bind_int64(stmt, 6, 0);
+		sqlite3_bind_int64(stmt, 7, 0);
+	} else {
+		sqlite3_bind_int64(stmt, 4, h0);
+		sqlite3_bind_int64(stmt, 5, d0 * 24);
+		sqlite3_bind_int64(stmt, 6, d1 * 24);
+		sqlite3_bind_int64(stmt, 7, h1);
+	}
+
+	r = sqlite3_step(stmt);
+	if (r != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	st->count = sqlite3_column_int64(stmt, 0);
+	if (st->count > 0) {
+		sum = sqlite3_column_int64(stmt, 1);
+		sumsq = sqlite3_column_int64(stmt, 2);
+		st->min = sqlite3_column_int(stmt, 3);
+		st->max = sqlite3_column_int(stmt, 4);
+		st->below = sqlite3_column_int64(stmt, 5);
+		st->inrange = sqlite3_column_int64(stmt, 6);
+		st->above = sqlite3_column_int64(stmt, 7);
+
+		st->mean = sum / st->count;
+		st->sd = sumsq / st->count - st->mean * st->mean;
+		st->sd = st->sd > 0 ? sqrt(st->sd) : 0;
+	}
+	sqlite3_reset(stmt);
+
+	return 0;
+}
+
+/*
+ * The time of the newest reading stored from a meter, or G_MININT64 when
+ * there is none. Inserting a batch with its meter set moves the mark up.
+ * Meters of one model on one port share a mark, and a meter whose clock
+ * was set back has readings below it; see meas_stored().
+ */
+gint64
+meas_meter_mark(struct gm_db *db, const char *meter)
+{
+	sqlite3_stmt	*stmt;
+	gint64		 mark = G_MININT64;
+
+	stmt = meas_stmt(db, GM_STMT_METER_MARK);
+	sqlite3_bind_text(stmt, 1, meter, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		mark = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return mark;
+}
+
+/*
+ * The time of the newest reading stored from a device, or G_MININT64 when
+ * there is none. It is found through the index on measurements.
+ */
+gint64
+meas_device_newest(struct gm_db *db, const char *device)
+{
+	sqlite3_stmt	*stmt;
+	gint64		 newest = G_MININT64;
+
+	stmt = meas_stmt(db, GM_STMT_DEVICE_NEWEST);
+	sqlite3_bind_text(stmt, 1, device, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+	    sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		newest = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return newest;
+}
+
+/* Whether a reading is stored already, found through the unique index */
+int
+meas_stored(struct gm_db *db, const char *device, gint64 time, int glucose)
+{
+	sqlite3_stmt	*stmt;
+	int		 stored;
+
+	stmt = meas_stmt(db, GM_STMT_STORED);
+	sqlite3_bind_text(stmt, 1, device, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, time);
+	sqlite3_bind_int(stmt, 3, glucose);
+	stored = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_reset(stmt);
+
+	return stored;
+}
+
 GtkTreeModel *
 meas_model(struct gm_conf *conf)
 {
-	GtkListStore	*store;
-	int		 r;
-	char		*errmsg;
+	/*
+	 * In WAL mode the writer thread can commit while this connection
+	 * reads, and commits don't have to wait for an fsync.
+	 */
+	sqlite3_busy_timeout(conf->db.handle, GM_BUSY_TIMEOUT);
+	sqlite3_exec(conf->db.handle, "PRAGMA journal_mode = WAL", NULL, NULL,
+	    NULL);
+
+	if (meas_schema(conf->db.handle) == -1)
+		return NULL;
 
-	r = sqlite3_exec(conf->sqlite3_handle, "CREATE TABLE IF NOT EXISTS measurements " \
-		" (glucose INTEGER, date DATETIME, device VARCHAR(255), " \
-		" UNIQUE (glucose, date, device))", NULL, NULL, &errmsg);
-	if (r != SQLITE_OK) {
+	/* All hot statements are prepared once and reused until meas_close() */
+	if (meas_db_prepare(&conf->db) == -1)
+		return NULL;
+
+	/*
+	 * Analysis runs on an in-memory copy of every reading. It starts from
+	 * the snapshot when there is a usable one and only reads the rows
+	 * added since; a missing or stale snapshot is rewritten in the
+	 * background.
+	 */
+	conf->cache = meascache_new(GM_SNAPSHOT_FILE);
+	if (conf->cache == NULL)
+		return NULL;
+	meascache_open(conf->cache, &conf->db);
+	if (meascache_sync(conf->cache, &conf->db) == -1)
+		return NULL;
+	meascache_save(conf->cache, 1);
+
+	conf->writer = dbwriter_start(conf, GM_DATABASE_FILE);
+	if (conf->writer == NULL)
 		return NULL;
+
+	/* Rows are read from the database when the view needs them */
+	return measmodel_new(conf);
+}
+
+/* The window, which the benchmarks are built without */
+#ifndef GM_BENCH
+/* A reading corrected by hand, within what the meter reads */
+static void
+gm_glucose_edited(GtkCellRendererText *renderer, gchar *path, gchar *text,
+    gpointer user)
+{
+	struct gm_conf	*conf = user;
+	GtkTreeIter	 iter;
+	const char	*errstr;
+	gint64		 rowid;
+	int		 glucose;
+
+	glucose = strtonum(text, 0, 400, &errstr);
+	if (errstr) {
+		fprintf(stderr, "glucose is %s: %s\n", errstr, text);
+		return;
 	}
 
-	store = gtk_list_store_new(GM_MEAS_NUM_COLS, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_STRING);
+	if (!gtk_tree_model_get_iter_from_string(conf->measurements, &iter,
+	    path))
+		return;
+	gtk_tree_model_get(conf->measurements, &iter, GM_MEAS_COL_ROWID,
+	    &rowid, -1);
 
-	r = meas_model_fill(conf, store);
-	if (r == -1)
-		goto fail;
+	if (meas_update(conf, rowid, glucose) == -1)
+		fprintf(stderr, "update: %s\n", sqlite3_errmsg(conf->db.handle));
+}
 
-	return GTK_TREE_MODEL(store);
-fail:
-	g_object_unref(store);
+/* Delete removes the selected reading */
+static gboolean
+gm_key_press(GtkWidget *view, GdkEventKey *event, gpointer user)
+{
+	struct gm_conf		*conf = user;
+	GtkTreeSelection	*selection;
+	GtkTreeModel		*model;
+	GtkTreeIter		 iter;
+	gint64			 rowid;
+
+	if (event->keyval != GDK_Delete)
+		return FALSE;
 
-	return NULL;
+	selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(view));
+	if (!gtk_tree_selection_get_selected(selection, &model, &iter))
+		return FALSE;
+	gtk_tree_model_get(model, &iter, GM_MEAS_COL_ROWID, &rowid, -1);
+
+	if (meas_delete(conf, rowid) == -1)
+		fprintf(stderr, "delete: %s\n", sqlite3_errmsg(conf->db.handle));
+
+	return TRUE;
 }
 
 static GtkWidget *
-glucose_listview(GtkTreeModel *model)
+glucose_listview(struct gm_conf *conf)
 {
+	GtkTreeModel *model = conf->measurements;
 	GtkWidget *view;
-	GtkCellRenderer *renderer;
+	GtkCellRenderer *renderer, *editable;
+	GtkTreeViewColumn *column;
+	int i;
 
 	view = gtk_tree_view_new();
 
 	renderer = gtk_cell_renderer_text_new();
+	editable = gtk_cell_renderer_text_new();
+	g_object_set(editable, "editable", TRUE, NULL);
+	g_signal_connect(editable, "edited", G_CALLBACK(gm_glucose_edited),
+	    conf);
 	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1,
 		"Date", renderer, "text", GM_MEAS_COL_DATE, NULL);
 	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1,
-		"Glucose", renderer, "text", GM_MEAS_COL_GLUCOSE, NULL);
+		"Glucose", editable, "text", GM_MEAS_COL_GLUCOSE, NULL);
 	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1,
 		"Device", renderer, "text", GM_MEAS_COL_DEVICE, NULL);
+	g_signal_connect(view, "key-press-event", G_CALLBACK(gm_key_press),
+	    conf);
+
+	/*
+	 * With fixed sizes the view only asks the model for the rows that are
+	 * visible, instead of measuring every row up front.
+	 */
+	for (i = 0; (column = gtk_tree_view_get_column(GTK_TREE_VIEW(view), i)); i++) {
+		gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+		gtk_tree_view_column_set_fixed_width(column, 150);
+	}
+	gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(view), TRUE);
 
 	gtk_tree_view_set_model(GTK_TREE_VIEW(view), model);
 
@@ -193,6 +1388,11 @@ progress_dialog_new(void)
 static gboolean
 gm_delete_cb(GtkWidget *widget, GdkEvent *event, gpointer data)
 {
+	GMainLoop	*loop = data;
+
+	/* Leave the main loop so main() can tear everything down */
+	g_main_loop_quit(loop);
+
 	return TRUE;
 }
 
@@ -207,11 +1407,27 @@ gm_refresh(GtkToolButton *button, gpointer user)
 {
 	struct gm_conf *conf = user;
 
-	meas_model_fill(conf, GTK_LIST_STORE(conf->measurements));
+	meas_model_fill(conf);
 
 	printf("refresh\n");
 }
 
+static void
+gm_device_done(struct device *dev, enum device_status status, void *arg)
+{
+	static const char	*what[] = {
+		"done", "failed", "error", "timeout"
+	};
+
+	printf("%s: %s\n", dev->name, what[status]);
+}
+
+static void
+gm_all_done(struct gm_conf *conf, void *arg)
+{
+	printf("All done!\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -219,29 +1435,42 @@ main(int argc, char *argv[])
 	GtkToolItem	*refresh;
 	GMainLoop	*loop;
 	struct gm_conf	 conf;
+	struct devicemgmt_listener listener = { gm_device_done, gm_all_done };
 	int r;
 
+	bzero(&conf, sizeof(conf));
 	devicemgmt_init(&conf);
 	gtk_init(&argc, &argv);
 
 	if (parse_config(GM_CONFIG_FILE, &conf))
 		exit(1);
 
-	devicemgmt_start(&conf);
+	if (trace_start(&conf) == -1)
+		exit(1);
 
-	r = sqlite3_open("database.sqlite3", &conf.sqlite3_handle);
+	r = sqlite3_open(GM_DATABASE_FILE, &conf.db.handle);
 	if (r != SQLITE_OK) {
 		// XXX: free handle;
 		return -1;
 	}
 
+	loop = g_main_loop_new(NULL, TRUE);
+
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-	g_signal_connect(window, "delete-event", G_CALLBACK(gm_delete_cb), NULL);
+	g_signal_connect(window, "delete-event", G_CALLBACK(gm_delete_cb), loop);
 	g_signal_connect(window, "destroy", G_CALLBACK(gm_destroy_cb), NULL);
 
 	conf.measurements = meas_model(&conf);
+	if (conf.measurements == NULL)
+		exit(1);
+
+	/* Downloads are inserted by the writer, which is running now */
+	devicemgmt_listen(&conf, &listener);
+	devicemgmt_start(&conf);
+	hotplug_start(&conf);
+	metrics_start(&conf);
 
-	view = glucose_listview(conf.measurements);
+	view = glucose_listview(&conf);
 
 	scrollview = gtk_scrolled_window_new(NULL, NULL);
 	gtk_scrolled_window_set_policy(scrollview, GTK_POLICY_AUTOMATIC,
@@ -263,9 +1492,14 @@ main(int argc, char *argv[])
 
 	gtk_widget_show_all(window);
 
-	loop = g_main_loop_new(NULL, TRUE);
-
 	g_main_loop_run(loop);
 
+	metrics_stop(&conf);
+	hotplug_stop(&conf);
+	devicemgmt_stop(&conf);
+	meas_close(&conf);
+	trace_stop(&conf);
+
 	return 0;
 }
+#endif /* GM_BENCH */
@@ -28,28 +28,323 @@ struct gm_conf;
 int	 parse_config(const char *, struct gm_conf *);
 
 /* glucosemeter.c */
+#define GM_DATABASE_FILE	"database.sqlite3"
+#define GM_SNAPSHOT_FILE	"database.snap"
+#define GM_BUSY_TIMEOUT		5000	/* ms */
+
+/* Target range for time-in-range, mg/dL */
+#define GM_RANGE_LOW		70
+#define GM_RANGE_HIGH		180
+
+/* Rollup rows covering every device */
+#define GM_DEVICE_ALL		0
+
 struct device;
+struct devicemgmt_listener;
+struct devicemgmt_hub;
+struct hotplug;
+struct metrics;
+struct dbwriter;
+struct reactor;
+
+/* Statements prepared once per connection and reused through meas_stmt() */
+enum gm_stmt {
+	GM_STMT_BEGIN,
+	GM_STMT_COMMIT,
+	GM_STMT_ROLLBACK,
+	GM_STMT_INSERT,
+	GM_STMT_DEVICE_INSERT,
+	GM_STMT_DEVICE_ID,
+	GM_STMT_COUNT,
+	GM_STMT_PAGE,
+	GM_STMT_SEEK,
+	GM_STMT_INDEX,
+	GM_STMT_DELETE,
+	GM_STMT_UPDATE,
+	GM_STMT_ROW_KEY,
+	GM_STMT_ROLLUP_HOUR_INIT,
+	GM_STMT_ROLLUP_HOUR_ADD,
+	GM_STMT_ROLLUP_DAY_INIT,
+	GM_STMT_ROLLUP_DAY_ADD,
+	GM_STMT_STATS,
+	GM_STMT_CACHE_LOAD,
+	GM_STMT_LAST_ROWID,
+	GM_STMT_STAGE,
+	GM_STMT_STAGED,
+	GM_STMT_UNSTAGE,
+	GM_STMT_METER_INIT,
+	GM_STMT_METER_ADD,
+	GM_STMT_METER_MARK,
+	GM_STMT_DEVICE_NEWEST,
+	GM_STMT_STORED,
+	GM_STMT_GENERATION,
+	GM_STMT_MAX
+};
+
+/* A database connection, only ever used by one thread */
+struct gm_db {
+	sqlite3			*handle;
+	sqlite3_stmt		*stmts[GM_STMT_MAX];
+	GHashTable		*device_ids;
+};
+
 struct gm_conf {
 	TAILQ_HEAD(, device)	 devices;
+	SLIST_HEAD(, devicemgmt_listener) listeners;
+	volatile gint		 active;	/* devices processing */
 	int			 devicemgmt_status;
-	sqlite3			*sqlite3_handle;
+	struct gm_db		 db;
+	struct dbwriter		*writer;
+	struct meascache	*cache;
+	int			 commit_window;	/* ms */
+	int			 commit_limit;	/* records */
+	int			 ingest_staged;
+	volatile gint		 downloads;	/* staged downloads so far */
+	int			 io_threads;
+	int			 retry_limit;
+	int			 retry_backoff;	/* ms */
+	int			 download_limit; /* at once, 0 for any */
+	int			 hub_limit;	/* at once behind a hub */
+	GMutex			 queue_lock;	/* the queue and what runs */
+	TAILQ_HEAD(, device)	 queue;		/* waiting, first goes first */
+	int			 queued;
+	int			 queued_max;
+	int			 running;
+	guint64			 started;
+	guint64			 wait_total;	/* us, queued to started */
+	guint64			 wait_max;	/* us */
+	GHashTable		*hubs;		/* path to devicemgmt_hub */
+	char			*metrics_socket; /* NULL for none */
+	struct metrics		*metrics;
+	char			*trace_file;	/* NULL for none */
+	struct reactor		**reactors;	/* io_threads of them */
+	int			 reactor_next;	/* for the next device */
+	SLIST_HEAD(, hotplug_pattern) patterns;
+	struct hotplug		*hotplug;
 	GtkTreeModel		*measurements;
 };
 
-int		 meas_insert(struct gm_conf *conf, int glucose, char *date, char *device);
+struct meas_record {
+	gint64		 time;
+	int		 glucose;
+};
+
+/* What the writer thread does with a batch */
+enum meas_batch_op {
+	MEAS_BATCH_INSERT,		/* insert the records */
+	MEAS_BATCH_STAGE,		/* hold the records of a download back */
+	MEAS_BATCH_PROMOTE,		/* insert what was held back */
+	MEAS_BATCH_DISCARD,		/* forget what was held back */
+};
+
+/* Readings of one device on their way to the database */
+struct meas_batch {
+	char			*device;
+	gint64			 queued;	/* monotonic time, us */
+	enum meas_batch_op	 op;
+	int			 download;	/* see meas_stage_begin() */
+	char			*meter;		/* see meas_meter_mark() */
+	int			 size;		/* records allocated */
+	int			 nrecords;
+	struct meas_record	 records[];
+};
+
+struct meas_stats {
+	gint64		 count;
+	double		 mean;
+	double		 sd;
+	int		 min;
+	int		 max;
+	gint64		 below;		/* < GM_RANGE_LOW */
+	gint64		 inrange;
+	gint64		 above;		/* > GM_RANGE_HIGH */
+};
+
+int		 meas_insert(struct gm_conf *conf, int glucose, time_t time, char *device);
+int		 meas_insert_batch(struct gm_conf *conf, struct meas_batch *batch);
+int		 meas_stage_begin(struct gm_conf *conf);
+void		 meas_stage(struct gm_conf *conf, struct meas_batch *batch,
+		     int download);
+void		 meas_stage_promote(struct gm_conf *conf, const char *device,
+		     const char *meter, int download, int nrecords);
+void		 meas_stage_discard(struct gm_conf *conf, const char *device,
+		     int download);
 GtkTreeModel	*meas_model(struct gm_conf *conf);
-int		 meas_model_fill(struct gm_conf *conf, GtkListStore *store);
+void		 meas_close(struct gm_conf *conf);
+int		 meas_db_prepare(struct gm_db *db);
+sqlite3_stmt	*meas_stmt(struct gm_db *db, enum gm_stmt which);
+int		 meas_db_begin(struct gm_db *db);
+int		 meas_db_insert(struct gm_db *db, struct meas_batch *batch);
+int		 meas_db_apply(struct gm_db *db, struct meas_batch *batch);
+int		 meas_db_commit(struct gm_db *db);
+void		 meas_db_rollback(struct gm_db *db);
+void		 meas_db_close(struct gm_db *db);
+struct meas_batch *meas_batch_new(const char *device, int nrecords);
+void		 meas_batch_free(struct meas_batch *batch);
+int		 meas_model_fill(struct gm_conf *conf);
+int		 meas_delete(struct gm_conf *conf, gint64 rowid);
+int		 meas_update(struct gm_conf *conf, gint64 rowid, int glucose);
+int		 meas_stats(struct gm_conf *conf, sqlite3_int64 device_id,
+		     time_t from, time_t to, struct meas_stats *st);
+gint64		 meas_meter_mark(struct gm_db *db, const char *meter);
+gint64		 meas_device_newest(struct gm_db *db, const char *device);
+int		 meas_stored(struct gm_db *db, const char *device, gint64 time,
+		    int glucose);
+
+/* measmodel.c */
+#define GM_MEAS_COL_GLUCOSE	0
+#define GM_MEAS_COL_DATE	1
+#define GM_MEAS_COL_DEVICE	2
+#define GM_MEAS_COL_ROWID	3
+#define GM_MEAS_NUM_COLS	4
+
+GtkTreeModel	*measmodel_new(struct gm_conf *conf);
+int		 measmodel_append(GtkTreeModel *model);
+int		 measmodel_index(GtkTreeModel *model, gint64 rowid);
+void		 measmodel_row_deleted(GtkTreeModel *model, int index);
+void		 measmodel_row_changed(GtkTreeModel *model, int index);
+
+/* meascache.c */
+struct meascache *meascache_new(const char *path);
+int		 meascache_open(struct meascache *mc, struct gm_db *db);
+int		 meascache_sync(struct meascache *mc, struct gm_db *db);
+void		 meascache_save(struct meascache *mc, int background);
+void		 meascache_invalidate(struct meascache *mc);
+int		 meascache_delete(struct meascache *mc, gint64 rowid,
+		    gint64 time, unsigned int device_id, int glucose);
+int		 meascache_update(struct meascache *mc, gint64 rowid,
+		    gint64 time, unsigned int device_id, int old, int glucose);
+int		 meascache_stats(struct meascache *mc, unsigned int device_id,
+		     time_t from, time_t to, struct meas_stats *st);
+int		 meascache_check(guint32 seed);
+void		 meascache_free(struct meascache *mc);
+
+/* dbwriter.c */
+#define DBWRITER_COMMIT_WINDOW	20	/* ms */
+#define DBWRITER_COMMIT_LIMIT	4096	/* records */
+
+struct dbwriter_stats {
+	guint64		 groups;	/* of batches written together */
+	guint64		 commits;	/* transactions that committed */
+	guint64		 batches;
+	guint64		 records;	/* in committed transactions */
+	guint64		 failures;
+	guint64		 max_batches;	/* most batches in one group */
+	guint64		 latency_total;	/* us, first batch queued to commit */
+	guint64		 latency_max;	/* us */
+};
+
+struct dbwriter	*dbwriter_start(struct gm_conf *conf, const char *path);
+void		 dbwriter_submit(struct dbwriter *writer, struct meas_batch *batch);
+void		 dbwriter_stats(struct dbwriter *writer, struct dbwriter_stats *stats);
+void		 dbwriter_stop(struct dbwriter *writer);
+
+/* reactor.c */
+#define REACTOR_THREADS		1
+#define REACTOR_MAX_THREADS	64
+
+struct reactor	*reactor_start(const char *path, int index);
+GSource		*reactor_watch(struct reactor *r, GIOChannel *channel,
+		     GIOCondition condition, GIOFunc func, gpointer data);
+GSource		*reactor_timer(struct reactor *r, GSourceFunc func,
+		     gpointer data);
+struct gm_db	*reactor_db(struct reactor *r);
+void		 reactor_stop(struct reactor *r);
+void		 reactor_free(struct reactor *r);
+void		 reactor_invoke(struct reactor *r, GSourceFunc func,
+		     gpointer data);
+
+/* hotplug.c */
+struct driver;
+
+/* Ports matching the pattern are started when they show up */
+struct hotplug_pattern {
+	char			*pattern;	/* absolute, fnmatch(3) */
+	struct driver		*driver;
+	SLIST_ENTRY(hotplug_pattern) entry;
+};
+
+void		 hotplug_start(struct gm_conf *conf);
+void		 hotplug_stop(struct gm_conf *conf);
 
 /* devicemgmt.c */
 struct driver;
+
+/* How a device finished */
+enum device_status {
+	DEVICE_DONE,		/* the download was handed to the writer */
+	DEVICE_FAILED,		/* the meter sent something we don't accept */
+	DEVICE_ERROR,		/* the port couldn't be opened or read */
+	DEVICE_TIMEOUT,		/* the meter stopped answering, every try */
+};
+
+#define DEVICE_RETRY_LIMIT	3	/* tries after the first timeout */
+#define DEVICE_RETRY_BACKOFF	500	/* ms, doubled every try */
+#define DEVICE_RETRY_MAX	30000	/* ms, longest wait */
+
+#define DEVICE_DOWNLOAD_LIMIT	0	/* downloads at once, 0 for any */
+#define DEVICE_HUB_LIMIT	2	/* downloads at once behind a hub */
+
+/* Where a device is in the queue, see devicemgmt_queue() */
+enum device_sched {
+	DEVICE_IDLE,
+	DEVICE_QUEUED,
+	DEVICE_RUNNING,
+};
+
 struct device {
 	struct driver	*driver;
 	GIOChannel	*channel;
 	struct gm_conf	*conf;
+	struct reactor	*reactor;	/* NULL is the main thread */
+	const char	*name;		/* for messages */
 	size_t		 length;
 	TAILQ_ENTRY(device)	 entry;
 
+	GSource		*in_source;
+	GSource		*err_source;
+	GSource		*out_source;	/* only while output is queued */
+	GByteArray	*outq;
+
 	int		 is_processing;
+	enum device_status status;	/* once it isn't processing */
+	GSource		*timer;		/* see devicemgmt_deadline() */
+	gint64		 deadline;	/* monotonic, us, 0 if none */
+	int		 retries;
+	int		 retrying;	/* waiting to start again */
+	int		 reopen;	/* see devicemgmt_reopen() */
+	int		 hotplugged;	/* see hotplug.c */
+
+	enum device_sched sched;
+	TAILQ_ENTRY(device) qentry;
+	struct devicemgmt_hub *hub;	/* NULL if not known */
+	gint64		 newest;	/* reading stored, orders the queue */
+	gint64		 queued;	/* monotonic, us */
+	gint64		 started;	/* monotonic, us */
+
+	/* Only written by the thread serving the device, see metrics.c */
+	guint64		 bytes_read;
+	guint64		 lines_read;
+
+	guint32		 trace_id;	/* see trace_device() */
+};
+
+struct devicemgmt_stats {
+	int		 queued;	/* waiting now */
+	int		 queued_max;	/* most waiting at once */
+	int		 running;
+	guint64		 started;	/* downloads */
+	guint64		 wait_total;	/* us, queued to started */
+	guint64		 wait_max;	/* us */
+};
+
+/* Told when a device finishes, and when the last one does */
+struct devicemgmt_listener {
+	void		(*device_done)(struct device *, enum device_status,
+			    void *);
+	void		(*all_done)(struct gm_conf *, void *);
+	void		*arg;
+	SLIST_ENTRY(devicemgmt_listener) entry;
 };
 
 struct driver {
@@ -58,14 +353,31 @@ struct driver {
 	int (*driver_stop_fn)(struct device *);
 
 	int (*driver_input)(struct device *, GIOChannel *gio);
-	int (*driver_output)(struct device *, GIOChannel *gio);
+	int (*driver_output)(struct device *, GIOChannel *gio);	/* all sent */
 	int (*driver_error)(struct device *, GIOChannel *gio);
+
+	struct device *(*driver_new_fn)(const char *);
+	void (*driver_free_fn)(struct device *);
 };
 
 void devicemgmt_init(struct gm_conf *);
 void devicemgmt_start(struct gm_conf *);
 void devicemgmt_stop(struct gm_conf *);
 int devicemgmt_status(struct gm_conf *);
+void devicemgmt_listen(struct gm_conf *, struct devicemgmt_listener *);
+void devicemgmt_begin(struct device *);
+void devicemgmt_done(struct device *, enum device_status);
+int devicemgmt_active(struct gm_conf *);
+void devicemgmt_add(struct gm_conf *, struct device *);
+void devicemgmt_remove(struct device *);
+void devicemgmt_reopen(struct device *);
+struct device *devicemgmt_find(struct gm_conf *, const char *);
+int devicemgmt_open(struct device *, int);
+void devicemgmt_write(struct device *, const void *, size_t);
+void devicemgmt_close(struct device *);
+void devicemgmt_deadline(struct device *, int);
+void devicemgmt_stats(struct gm_conf *, struct devicemgmt_stats *);
+struct gm_db *devicemgmt_db(struct device *);
 
 gboolean devicemgmt_input(GIOChannel *gio, GIOCondition condition, gpointer data);
 gboolean devicemgmt_output(GIOChannel *gio, GIOCondition condition, gpointer data);
@@ -73,6 +385,10 @@ gboolean devicemgmt_error(GIOChannel *gio, GIOCondition condition, gpointer data
 
 /* abfr.c */
 #define ABFR_MAX_ENTRIES	450
+#define ABFR_INBUF_SIZE		1024	/* longest line we accept, and then some */
+#define ABFR_STAGE_CHUNK	32	/* results per staged batch */
+#define ABFR_TIMEOUT_ANSWER	5000	/* ms, for the first line */
+#define ABFR_TIMEOUT_LINE	2000	/* ms, for the lines after it */
 
 // XXX: do these include the NULL terminator?
 #define ABFR_ENTRYLEN	31
@@ -95,14 +411,6 @@ enum abfr_softrev {
 	ABFR_SOFT_1_43_P,
 };
 
-struct abfr_entry {
-	int		bloodglucose;
-	struct tm	ptm;
-	int		plasmatype;
-
-	SLIST_ENTRY(abfr_entry) next;
-};
-
 struct abfr_dev {
 	struct device			 device;
 	char				*file;
@@ -121,7 +429,119 @@ struct abfr_dev {
 	uint16_t			 checksum;
 	int				 nresults;
 	int				 results_processed;
-	SLIST_HEAD(, abfr_entry)	 entries;
+	struct meas_batch		*batch;		/* results so far */
+	int				 download;	/* staged, 0 if not */
+	char				*meter;		/* port, type and revision */
+	gint64				 mark;		/* newest reading we have */
+	int				 skipping;	/* results below the mark */
+
+	/* Bytes read from the meter, starting with an unfinished line */
+	char				 inbuf[ABFR_INBUF_SIZE];
+	size_t				 inlen;
+};
+
+struct abfr_dev *abfr_init(const char *);
+
+/* abfrscan.c */
+int		 abfr_scanline(const char *p, int *glucose, time_t *time);
+uint16_t	 abfr_calc_checksum(const char *line, size_t len);
+
+/* metrics.c */
+enum metric {
+	/* by the state the download was in, see metrics.c */
+	METRIC_ABFR_FAILURES,
+	METRIC_ABFR_CHECKSUM = METRIC_ABFR_FAILURES + ABFR_FAIL,
+	/* by enum device_status */
+	METRIC_DOWNLOADS,
+	METRIC_RETRIES = METRIC_DOWNLOADS + DEVICE_TIMEOUT + 1,
+	METRIC_MAX
 };
 
-struct abfr_dev *abfr_init(char *);
+enum metric_histogram {
+	METRIC_DOWNLOAD_TIME,		/* started to done */
+	METRIC_INSERT_TIME,		/* queued to committed, per batch */
+	METRIC_MODEL_FILL_TIME,
+	METRIC_HISTOGRAM_MAX
+};
+
+void		 metrics_count(enum metric m, guint64 n);
+void		 metrics_observe(enum metric_histogram h, gint64 us);
+int		 metrics_start(struct gm_conf *conf);
+void		 metrics_stop(struct gm_conf *conf);
+
+/* trace.c */
+#define TRACE_MAGIC		"GMTRACE1"
+#define TRACE_RECORDS		4096	/* per thread, a power of two */
+#define TRACE_DEVICES		256	/* whose names are kept */
+
+/* The arguments follow the name; keep in the same order as tracedump.c */
+enum trace_event {
+	TRACE_DEVICE_START,		/* retries */
+	TRACE_DEVICE_TIMEOUT,		/* retries, backoff in ms */
+	TRACE_DEVICE_DONE,		/* enum device_status */
+	TRACE_ABFR_NOT_PROCESSING,
+	TRACE_ABFR_READ,		/* bytes */
+	TRACE_ABFR_READ_ERROR,		/* errno */
+	TRACE_ABFR_LINE,		/* length, the first 8 bytes */
+	TRACE_ABFR_LINE_LONG,		/* bytes buffered */
+	TRACE_ABFR_STATE,		/* old state, new state */
+	TRACE_ABFR_DEVICE_TYPE,		/* enum abfr_devtype */
+	TRACE_ABFR_SOFTREV,		/* enum abfr_softrev */
+	TRACE_ABFR_DATETIME,		/* the meter's time */
+	TRACE_ABFR_NRESULTS,		/* results announced */
+	TRACE_ABFR_RESULT,		/* glucose, time */
+	TRACE_ABFR_SKIP,		/* time, the newest we have */
+	TRACE_ABFR_CHECKSUM,		/* ours, the meter's */
+	TRACE_ABFR_INSERT_FAILED,
+	TRACE_ABFR_SENT,
+	TRACE_ABFR_PORT_ERROR,
+	TRACE_MAX
+};
+
+struct trace_record {
+	gint64		 time;		/* monotonic, us */
+	guint32		 device;	/* 0 for none */
+	guint16		 event;		/* enum trace_event */
+	guint16		 thread;
+	gint64		 args[2];
+};
+
+/*
+ * trace_dump() writes a trace_file_header, a trace_file_name and the name
+ * of each device, then a trace_file_ring and its records for each thread,
+ * in the byte order of the machine that wrote it.
+ */
+struct trace_file_header {
+	char		 magic[8];	/* TRACE_MAGIC */
+	guint32		 records;	/* per ring */
+	guint32		 devices;
+	guint32		 rings;
+	guint32		 pad;
+};
+
+struct trace_file_name {
+	guint32		 device;
+	guint32		 len;		/* the name follows, not terminated */
+};
+
+struct trace_file_ring {
+	guint32		 thread;
+	guint32		 head;		/* the next record written */
+};
+
+/* Tracepoints cost nothing unless built with -DGM_TRACE */
+#ifdef GM_TRACE
+#define TRACEPOINT(ev, dev, a, b)	trace_record((ev), (dev), (a), (b))
+#define TRACEPOINT_DEVICE(dev)		trace_device(dev)
+#else
+#define TRACEPOINT(ev, dev, a, b)	do { } while (0)
+#define TRACEPOINT_DEVICE(dev)		do { } while (0)
+#endif
+
+void		 trace_record(enum trace_event ev, struct device *dev,
+		    gint64 a, gint64 b);
+void		 trace_device(struct device *dev);
+gint64		 trace_text(const char *s, size_t len);
+int		 trace_dump(const char *path);
+int		 trace_start(struct gm_conf *conf);
+void		 trace_stop(struct gm_conf *conf);
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Meters are downloaded as soon as they are plugged in. The directories of
+ * the "glucosemeter abfr match" patterns are watched, and a port that shows
+ * up and matches one is started like a configured one. When it goes away
+ * it is taken down, a download still running ends with an error.
+ *
+ * On Linux the directories are watched with inotify(7), elsewhere they are
+ * read again every HOTPLUG_POLL_INTERVAL. Only the last component of a
+ * pattern may have wildcards.
+ *
+ * A port is downloaded once while it is plugged in. One that failed to
+ * open, usually because udev hadn't set its permissions yet, is tried
+ * again when its attributes change, also when that happens while it is
+ * still being opened. Polling doesn't see such changes, there a port is
+ * only tried again once it is plugged in again.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+#define HOTPLUG_POLL_INTERVAL	1000	/* ms, without inotify */
+
+struct hotplug_dir {
+	char			*path;
+	int			 wd;		/* inotify watch */
+	SLIST_ENTRY(hotplug_dir) entry;
+};
+
+struct hotplug {
+	struct gm_conf		*conf;
+	SLIST_HEAD(, hotplug_dir) dirs;
+	int			 fd;		/* inotify, or -1 */
+	guint			 source;
+};
+
+static struct hotplug_pattern *
+hotplug_match(struct hotplug *h, const char *path)
+{
+	struct hotplug_pattern *p;
+
+	SLIST_FOREACH(p, &h->conf->patterns, entry) {
+		if (fnmatch(p->pattern, path, FNM_PATHNAME) == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+/* Configured ports and ones already started are left alone */
+static void
+hotplug_added(struct hotplug *h, const char *path)
+{
+	struct hotplug_pattern	*p;
+	struct device		*dev;
+
+	if ((p = hotplug_match(h, path)) == NULL)
+		return;
+
+	if (devicemgmt_find(h->conf, path) != NULL)
+		return;
+
+	if ((dev = p->driver->driver_new_fn(path)) == NULL) {
+		g_warning("hotplug: %s: %s", path, strerror(errno));
+		return;
+	}
+	dev->hotplugged = 1;
+
+	printf("%s: plugged in\n", path);
+
+	devicemgmt_add(h->conf, dev);
+}
+
+static void
+hotplug_removed(struct hotplug *h, const char *path)
+{
+	struct device		*dev;
+
+	dev = devicemgmt_find(h->conf, path);
+	if (dev == NULL || !dev->hotplugged)
+		return;
+
+	printf("%s: unplugged\n", path);
+
+	devicemgmt_remove(dev);
+}
+
+/* The port couldn't be opened before, it might now */
+static void
+hotplug_changed(struct hotplug *h, const char *path)
+{
+	struct device		*dev;
+
+	dev = devicemgmt_find(h->conf, path);
+	if (dev == NULL || !dev->hotplugged)
+		return;
+
+	devicemgmt_reopen(dev);
+}
+
+/* Start what is there, and with polling take down what isn't */
+static void
+hotplug_scan(struct hotplug *h)
+{
+	struct hotplug_dir	*d;
+	struct device		*dev, *next;
+	struct dirent		*de;
+	struct stat		 sb;
+	DIR			*dir;
+	char			 path[PATH_MAX];
+
+	if (h->fd == -1) {
+		for (dev = TAILQ_FIRST(&h->conf->devices); dev != NULL;
+		    dev = next) {
+			next = TAILQ_NEXT(dev, entry);
+			if (dev->hotplugged && stat(dev->name, &sb) == -1 &&
+			    errno == ENOENT)
+				hotplug_removed(h, dev->name);
+		}
+	}
+
+	SLIST_FOREACH(d, &h->dirs, entry) {
+		if ((dir = opendir(d->path)) == NULL)
+			continue;
+
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", d->path,
+			    de->d_name);
+			hotplug_added(h, path);
+		}
+
+		closedir(dir);
+	}
+}
+
+static gboolean
+hotplug_poll(gpointer data)
+{
+	hotplug_scan(data);
+
+	return TRUE;
+}
+
+#ifdef __linux__
+static gboolean
+hotplug_inotify(GIOChannel *gio, GIOCondition condition, gpointer data)
+{
+	struct hotplug		*h = data;
+	struct hotplug_dir	*d;
+	struct inotify_event	*ev;
+	char			 buf[4096] __attribute__((__aligned__(8)));
+	char			 path[PATH_MAX];
+	ssize_t			 len;
+	char			*p;
+
+	while ((len = read(h->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len;
+		    p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			/* Events were dropped, see what is there now */
+			if (ev->mask & IN_Q_OVERFLOW) {
+				hotplug_scan(h);
+				continue;
+			}
+
+			if (ev->len == 0)
+				continue;
+
+			SLIST_FOREACH(d, &h->dirs, entry) {
+				if (d->wd == ev->wd)
+					break;
+			}
+			if (d == NULL)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", d->path,
+			    ev->name);
+
+			/* A new node replaces whatever had the name before */
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				hotplug_removed(h, path);
+				hotplug_added(h, path);
+			}
+			else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				hotplug_removed(h, path);
+			else if (ev->mask & IN_ATTRIB)
+				hotplug_changed(h, path);
+		}
+	}
+
+	if (len == -1 && errno != EAGAIN && errno != EINTR) {
+		g_warning("hotplug: %s", strerror(errno));
+		h->source = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+#endif
+
+static void
+hotplug_watch(struct hotplug *h, const char *pattern)
+{
+	struct hotplug_dir	*d;
+	char			*path;
+
+	path = g_path_get_dirname(pattern);
+	if (strpbrk(path, "*?[") != NULL) {
+		g_warning("hotplug: %s: only the last component may match",
+		    pattern);
+		g_free(path);
+		return;
+	}
+
+	SLIST_FOREACH(d, &h->dirs, entry) {
+		if (strcmp(d->path, path) == 0) {
+			g_free(path);
+			return;
+		}
+	}
+
+	d = g_new0(struct hotplug_dir, 1);
+	d->path = path;
+	d->wd = -1;
+
+#ifdef __linux__
+	if (h->fd != -1) {
+		d->wd = inotify_add_watch(h->fd, path, IN_CREATE | IN_DELETE |
+		    IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR);
+		if (d->wd == -1)
+			g_warning("hotplug: %s: %s", path, strerror(errno));
+	}
+#endif
+
+	SLIST_INSERT_HEAD(&h->dirs, d, entry);
+}
+
+/* From the main thread, after devicemgmt_start() */
+void
+hotplug_start(struct gm_conf *conf)
+{
+	struct hotplug		*h;
+	struct hotplug_pattern	*p;
+
+	if (SLIST_EMPTY(&conf->patterns))
+		return;
+
+	h = g_new0(struct hotplug, 1);
+	h->conf = conf;
+	h->fd = -1;
+	SLIST_INIT(&h->dirs);
+
+#ifdef __linux__
+	h->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (h->fd == -1)
+		g_warning("hotplug: inotify: %s", strerror(errno));
+#endif
+
+	SLIST_FOREACH(p, &conf->patterns, entry)
+		hotplug_watch(h, p->pattern);
+
+#ifdef __linux__
+	if (h->fd != -1) {
+		GIOChannel *channel;
+
+		channel = g_io_channel_unix_new(h->fd);
+		h->source = g_io_add_watch(channel, G_IO_IN,
+		    hotplug_inotify, h);
+		g_io_channel_unref(channel);
+	}
+#endif
+	if (h->fd == -1)
+		h->source = g_timeout_add(HOTPLUG_POLL_INTERVAL,
+		    hotplug_poll, h);
+
+	conf->hotplug = h;
+
+	hotplug_scan(h);
+}
+
+/* Before devicemgmt_stop(), which stops what was plugged in */
+void
+hotplug_stop(struct gm_conf *conf)
+{
+	struct hotplug		*h = conf->hotplug;
+	struct hotplug_dir	*d;
+
+	if (h == NULL)
+		return;
+
+	if (h->source != 0)
+		g_source_remove(h->source);
+	if (h->fd != -1)
+		close(h->fd);
+
+	while ((d = SLIST_FIRST(&h->dirs)) != NULL) {
+		SLIST_REMOVE_HEAD(&h->dirs, entry);
+		g_free(d->path);
+		g_free(d);
+	}
+
+	g_free(h);
+	conf->hotplug = NULL;
+}
@@ -0,0 +1,1061 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An in-memory copy of all readings, one array per column and sorted by
+ * time. A time window is found with a binary search; the statistics over
+ * it are computed with SSE2 or AVX2 where available and plain C otherwise.
+ *
+ * The kernels assume 0 <= glucose <= MEASCACHE_GLUCOSE_MAX, which keeps
+ * the 32 bit partial sums from overflowing within a block.
+ *
+ * The columns are also written to a snapshot file. On startup it is mapped
+ * read-only and only the rows added since are read from the database; the
+ * first change copies the columns to the heap. Rows changed or deleted in
+ * the database bump its generation, a snapshot or cache of an older one
+ * is read again.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MEASCACHE_X86
+#include <immintrin.h>
+#endif
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+#define MEASCACHE_GLUCOSE_MAX	1023
+#define MEASCACHE_BLOCK		4096	/* elements between 32 bit flushes */
+
+#define MEASCACHE_MAGIC		"GMCACHE"
+#define MEASCACHE_VERSION	2
+#define MEASCACHE_ENDIAN	0x01020304
+#define MEASCACHE_SAVE_INTERVAL	60	/* s, between background rebuilds */
+
+/*
+ * The snapshot file: this header followed by the time, glucose and device
+ * columns, each padded to a multiple of 8 bytes. The checksum covers
+ * everything after the header.
+ */
+struct meascache_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 endian;
+	uint64_t	 count;
+	int64_t		 last_rowid;
+	int64_t		 generation;	/* of the database */
+	uint64_t	 checksum;
+};
+
+#define MEASCACHE_PAD(len)	(((len) + 7) & ~(size_t)7)
+
+struct meascache {
+	int64_t		*time;
+	int16_t		*glucose;
+	uint16_t	*device;
+	size_t		 n;
+	size_t		 size;
+	int64_t		 last_rowid;
+	int64_t		 generation;	/* the columns are of */
+	int		 stale;
+
+	char		*path;		/* snapshot */
+	void		*map;		/* columns point into it when set */
+	size_t		 maplen;
+	int		 dirty;		/* differs from the snapshot */
+	gint64		 saved;		/* monotonic time, us */
+	GThread		*saver;
+	gint		 saving;
+};
+
+/* A snapshot image on its way to disk */
+struct meascache_image {
+	char		*path;
+	char		*data;
+	size_t		 len;
+	gint		*saving;
+};
+
+/* Partial results of a kernel over a slice of the columns */
+struct meascache_acc {
+	int64_t		 count;
+	int64_t		 sum;
+	int64_t		 sumsq;
+	int		 min;
+	int		 max;
+	int64_t		 below;
+	int64_t		 above;
+};
+
+typedef void (*meascache_kernel)(const int16_t *, const uint16_t *, size_t,
+    unsigned int, struct meascache_acc *);
+
+static void
+meascache_scalar(const int16_t *g, const uint16_t *dev, size_t n,
+    unsigned int device_id, struct meascache_acc *acc)
+{
+	size_t	 i;
+	int	 v;
+
+	for (i = 0; i < n; i++) {
+		if (device_id != GM_DEVICE_ALL && dev[i] != device_id)
+			continue;
+
+		v = g[i];
+		acc->count++;
+		acc->sum += v;
+		acc->sumsq += v * v;
+		if (v < acc->min)
+			acc->min = v;
+		if (v > acc->max)
+			acc->max = v;
+		if (v < GM_RANGE_LOW)
+			acc->below++;
+		else if (v > GM_RANGE_HIGH)
+			acc->above++;
+	}
+}
+
+#ifdef MEASCACHE_X86
+static int64_t
+meascache_hsum32(__m128i v)
+{
+	int32_t	 l[4];
+
+	_mm_storeu_si128((__m128i *)l, v);
+
+	return (int64_t)l[0] + l[1] + l[2] + l[3];
+}
+
+static int64_t
+meascache_hsum16(__m128i v)
+{
+	/* Lanes hold counts, never more than a block's worth */
+	return meascache_hsum32(_mm_madd_epi16(v, _mm_set1_epi16(1)));
+}
+
+static int
+meascache_hmin16(__m128i v)
+{
+	int16_t	 l[8];
+	int	 i, m;
+
+	_mm_storeu_si128((__m128i *)l, v);
+	for (m = l[0], i = 1; i < 8; i++)
+		if (l[i] < m)
+			m = l[i];
+
+	return m;
+}
+
+static int
+meascache_hmax16(__m128i v)
+{
+	int16_t	 l[8];
+	int	 i, m;
+
+	_mm_storeu_si128((__m128i *)l, v);
+	for (m = l[0], i = 1; i < 8; i++)
+		if (l[i] > m)
+			m = l[i];
+
+	return m;
+}
+
+static void
+meascache_sse2(const int16_t *g, const uint16_t *dev, size_t n,
+    unsigned int device_id, struct meascache_acc *acc)
+{
+	const __m128i	 ones = _mm_set1_epi16(1);
+	const __m128i	 low = _mm_set1_epi16(GM_RANGE_LOW);
+	const __m128i	 high = _mm_set1_epi16(GM_RANGE_HIGH);
+	const __m128i	 vdev = _mm_set1_epi16((int16_t)device_id);
+	const __m128i	 vmax = _mm_set1_epi16(INT16_MAX);
+	const __m128i	 vmin = _mm_set1_epi16(INT16_MIN);
+	__m128i		 sum, sumsq, cnt, below, above, mn, mx;
+	__m128i		 v, mask;
+	size_t		 i, end, block;
+
+	mn = vmax;
+	mx = vmin;
+
+	for (i = 0; i + 8 <= n; ) {
+		sum = sumsq = cnt = below = above = _mm_setzero_si128();
+
+		block = n - i < MEASCACHE_BLOCK ? n - i : MEASCACHE_BLOCK;
+		for (end = i + (block & ~(size_t)7); i < end; i += 8) {
+			v = _mm_loadu_si128((const __m128i *)(g + i));
+			if (device_id == GM_DEVICE_ALL)
+				mask = _mm_cmpeq_epi16(v, v);
+			else
+				mask = _mm_cmpeq_epi16(vdev,
+				    _mm_loadu_si128((const __m128i *)(dev + i)));
+			v = _mm_and_si128(v, mask);
+
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(v, ones));
+			sumsq = _mm_add_epi32(sumsq, _mm_madd_epi16(v, v));
+			cnt = _mm_sub_epi16(cnt, mask);
+			below = _mm_sub_epi16(below,
+			    _mm_and_si128(mask, _mm_cmplt_epi16(v, low)));
+			above = _mm_sub_epi16(above,
+			    _mm_and_si128(mask, _mm_cmpgt_epi16(v, high)));
+			mn = _mm_min_epi16(mn, _mm_or_si128(v,
+			    _mm_andnot_si128(mask, vmax)));
+			mx = _mm_max_epi16(mx, _mm_or_si128(v,
+			    _mm_andnot_si128(mask, vmin)));
+		}
+
+		acc->sum += meascache_hsum32(sum);
+		acc->sumsq += meascache_hsum32(sumsq);
+		acc->count += meascache_hsum16(cnt);
+		acc->below += meascache_hsum16(below);
+		acc->above += meascache_hsum16(above);
+	}
+
+	if (acc->count > 0) {
+		if (meascache_hmin16(mn) < acc->min)
+			acc->min = meascache_hmin16(mn);
+		if (meascache_hmax16(mx) > acc->max)
+			acc->max = meascache_hmax16(mx);
+	}
+
+	meascache_scalar(g + i, dev + i, n - i, device_id, acc);
+}
+
+__attribute__((target("avx2")))
+static void
+meascache_avx2(const int16_t *g, const uint16_t *dev, size_t n,
+    unsigned int device_id, struct meascache_acc *acc)
+{
+	const __m256i	 ones = _mm256_set1_epi16(1);
+	const __m256i	 low = _mm256_set1_epi16(GM_RANGE_LOW);
+	const __m256i	 high = _mm256_set1_epi16(GM_RANGE_HIGH);
+	const __m256i	 vdev = _mm256_set1_epi16((int16_t)device_id);
+	const __m256i	 vmax = _mm256_set1_epi16(INT16_MAX);
+	const __m256i	 vmin = _mm256_set1_epi16(INT16_MIN);
+	__m256i		 sum, sumsq, cnt, below, above, mn, mx;
+	__m256i		 v, mask;
+	size_t		 i, end, block;
+
+	mn = vmax;
+	mx = vmin;
+
+	for (i = 0; i + 16 <= n; ) {
+		sum = sumsq = cnt = below = above = _mm256_setzero_si256();
+
+		block = n - i < MEASCACHE_BLOCK ? n - i : MEASCACHE_BLOCK;
+		for (end = i + (block & ~(size_t)15); i < end; i += 16) {
+			v = _mm256_loadu_si256((const __m256i *)(g + i));
+			if (device_id == GM_DEVICE_ALL)
+				mask = _mm256_cmpeq_epi16(v, v);
+			else
+				mask = _mm256_cmpeq_epi16(vdev,
+				    _mm256_loadu_si256((const __m256i *)(dev + i)));
+			v = _mm256_and_si256(v, mask);
+
+			sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, ones));
+			sumsq = _mm256_add_epi32(sumsq, _mm256_madd_epi16(v, v));
+			cnt = _mm256_sub_epi16(cnt, mask);
+			below = _mm256_sub_epi16(below,
+			    _mm256_and_si256(mask, _mm256_cmpgt_epi16(low, v)));
+			above = _mm256_sub_epi16(above,
+			    _mm256_and_si256(mask, _mm256_cmpgt_epi16(v, high)));
+			mn = _mm256_min_epi16(mn, _mm256_or_si256(v,
+			    _mm256_andnot_si256(mask, vmax)));
+			mx = _mm256_max_epi16(mx, _mm256_or_si256(v,
+			    _mm256_andnot_si256(mask, vmin)));
+		}
+
+		acc->sum += meascache_hsum32(_mm_add_epi32(
+		    _mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+		acc->sumsq += meascache_hsum32(_mm_add_epi32(
+		    _mm256_castsi256_si128(sumsq),
+		    _mm256_extracti128_si256(sumsq, 1)));
+		acc->count += meascache_hsum16(_mm_add_epi16(
+		    _mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1)));
+		acc->below += meascache_hsum16(_mm_add_epi16(
+		    _mm256_castsi256_si128(below),
+		    _mm256_extracti128_si256(below, 1)));
+		acc->above += meascache_hsum16(_mm_add_epi16(
+		    _mm256_castsi256_si128(above),
+		    _mm256_extracti128_si256(above, 1)));
+	}
+
+	if (acc->count > 0) {
+		int	 m;
+
+		m = meascache_hmin16(_mm_min_epi16(_mm256_castsi256_si128(mn),
+		    _mm256_extracti128_si256(mn, 1)));
+		if (m < acc->min)
+			acc->min = m;
+		m = meascache_hmax16(_mm_max_epi16(_mm256_castsi256_si128(mx),
+		    _mm256_extracti128_si256(mx, 1)));
+		if (m > acc->max)
+			acc->max = m;
+	}
+
+	meascache_scalar(g + i, dev + i, n - i, device_id, acc);
+}
+#endif /* MEASCACHE_X86 */
+
+static meascache_kernel
+meascache_select(void)
+{
+	static meascache_kernel	 kernel;
+
+	if (kernel != NULL)
+		return kernel;
+
+	kernel = meascache_scalar;
+#ifdef MEASCACHE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernel = meascache_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		kernel = meascache_sse2;
+#endif
+
+	return kernel;
+}
+
+struct meascache *
+meascache_new(const char *path)
+{
+	struct meascache	*mc;
+
+	if ((mc = calloc(1, sizeof(*mc))) == NULL)
+		return NULL;
+
+	mc->path = g_strdup(path);
+
+	return mc;
+}
+
+/* Drop the columns, whether they live on the heap or in the snapshot */
+static void
+meascache_release(struct meascache *mc)
+{
+	if (mc->map != NULL)
+		munmap(mc->map, mc->maplen);
+	else {
+		free(mc->time);
+		free(mc->glucose);
+		free(mc->device);
+	}
+
+	mc->map = NULL;
+	mc->maplen = 0;
+	mc->time = NULL;
+	mc->glucose = NULL;
+	mc->device = NULL;
+	mc->n = mc->size = 0;
+	mc->last_rowid = 0;
+}
+
+void
+meascache_free(struct meascache *mc)
+{
+	if (mc == NULL)
+		return;
+
+	if (mc->saver != NULL)
+		g_thread_join(mc->saver);
+
+	meascache_release(mc);
+	g_free(mc->path);
+	free(mc);
+}
+
+static int
+meascache_reserve(struct meascache *mc, size_t n)
+{
+	int64_t		*time;
+	int16_t		*glucose;
+	uint16_t	*device;
+	size_t		 size;
+
+	if (n <= mc->size && mc->map == NULL)
+		return 0;
+
+	for (size = mc->size ? mc->size : 1024; size < n; size *= 2)
+		;
+
+	if (mc->map != NULL) {
+		/* The snapshot is mapped read-only, the first change copies it */
+		time = malloc(size * sizeof(*time));
+		glucose = malloc(size * sizeof(*glucose));
+		device = malloc(size * sizeof(*device));
+		if (time == NULL || glucose == NULL || device == NULL) {
+			free(time);
+			free(glucose);
+			free(device);
+			return -1;
+		}
+
+		memcpy(time, mc->time, mc->n * sizeof(*time));
+		memcpy(glucose, mc->glucose, mc->n * sizeof(*glucose));
+		memcpy(device, mc->device, mc->n * sizeof(*device));
+
+		munmap(mc->map, mc->maplen);
+		mc->map = NULL;
+		mc->maplen = 0;
+	} else {
+		if ((time = realloc(mc->time, size * sizeof(*time))) == NULL)
+			return -1;
+		mc->time = time;
+		if ((glucose = realloc(mc->glucose,
+		    size * sizeof(*glucose))) == NULL)
+			return -1;
+		mc->glucose = glucose;
+		if ((device = realloc(mc->device,
+		    size * sizeof(*device))) == NULL)
+			return -1;
+	}
+
+	mc->time = time;
+	mc->glucose = glucose;
+	mc->device = device;
+	mc->size = size;
+
+	return 0;
+}
+
+/* The kernels' range, see above */
+static int16_t
+meascache_clamp(int glucose)
+{
+	if (glucose < 0)
+		return 0;
+	if (glucose > MEASCACHE_GLUCOSE_MAX)
+		return MEASCACHE_GLUCOSE_MAX;
+
+	return glucose;
+}
+
+/* First index with a time >= t */
+static size_t
+meascache_lower_bound(struct meascache *mc, int64_t t)
+{
+	size_t	 lo = 0, hi = mc->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mc->time[mid] < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* A row read from the database, before it is merged in */
+struct meascache_row {
+	int64_t		 time;
+	int16_t		 glucose;
+	uint16_t	 device;
+};
+
+static int
+meascache_row_cmp(const void *a, const void *b)
+{
+	const struct meascache_row	*ra = a, *rb = b;
+
+	return (ra->time > rb->time) - (ra->time < rb->time);
+}
+
+/*
+ * Merge rows sorted by time into the columns, from the back so nothing has
+ * to move twice. Rows mostly arrive in time order, which makes this an
+ * append.
+ */
+static int
+meascache_merge(struct meascache *mc, struct meascache_row *rows, size_t k)
+{
+	size_t	 i, j, out;
+
+	if (k == 0)
+		return 0;
+
+	if (meascache_reserve(mc, mc->n + k) == -1)
+		return -1;
+
+	i = mc->n;
+	j = k;
+	out = mc->n + k;
+	while (j > 0) {
+		out--;
+		if (i > 0 && mc->time[i - 1] > rows[j - 1].time) {
+			i--;
+			mc->time[out] = mc->time[i];
+			mc->glucose[out] = mc->glucose[i];
+			mc->device[out] = mc->device[i];
+		} else {
+			j--;
+			mc->time[out] = rows[j].time;
+			mc->glucose[out] = rows[j].glucose;
+			mc->device[out] = rows[j].device;
+		}
+	}
+
+	mc->n += k;
+	mc->dirty = 1;
+
+	return 0;
+}
+
+/* Bumped with every reading changed or deleted, -1 on error */
+static int64_t
+meascache_generation(struct gm_db *db)
+{
+	sqlite3_stmt	*stmt;
+	int64_t		 generation = -1;
+
+	stmt = meas_stmt(db, GM_STMT_GENERATION);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		generation = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return generation;
+}
+
+/*
+ * Load the rows which aren't in the cache yet. The first call, and one
+ * after rows were changed or deleted, loads the whole table.
+ */
+int
+meascache_sync(struct meascache *mc, struct gm_db *db)
+{
+	struct meascache_row	*rows = NULL, *p;
+	sqlite3_stmt		*stmt;
+	size_t			 k = 0, size = 0;
+	int64_t			 generation;
+	int			 r, sorted = 1;
+
+	/* Before the rows, a change in between only means reading again */
+	if ((generation = meascache_generation(db)) == -1)
+		return -1;
+
+	if (mc->stale || generation != mc->generation) {
+		meascache_release(mc);
+		mc->generation = generation;
+		mc->stale = 0;
+		mc->dirty = 1;
+	}
+
+	stmt = meas_stmt(db, GM_STMT_CACHE_LOAD);
+	sqlite3_bind_int64(stmt, 1, mc->last_rowid);
+
+	while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (k == size) {
+			size = size ? size * 2 : 1024;
+			if ((p = realloc(rows, size * sizeof(*rows))) == NULL)
+				break;
+			rows = p;
+		}
+
+		rows[k].time = sqlite3_column_int64(stmt, 1);
+		rows[k].glucose = meascache_clamp(sqlite3_column_int(stmt, 2));
+		rows[k].device = sqlite3_column_int(stmt, 3);
+		if (k > 0 && rows[k].time < rows[k - 1].time)
+			sorted = 0;
+		k++;
+
+		mc->last_rowid = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_reset(stmt);
+
+	if (!sorted)
+		qsort(rows, k, sizeof(*rows), meascache_row_cmp);
+
+	if (meascache_merge(mc, rows, k) == -1)
+		r = SQLITE_NOMEM;
+	free(rows);
+
+	return r == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Find a row among those of its time, -1 when it isn't there. The unique
+ * index on (device_id, time, glucose) makes it the only one.
+ */
+static ssize_t
+meascache_find(struct meascache *mc, int64_t time, unsigned int device_id,
+    int glucose)
+{
+	size_t	 i;
+
+	for (i = meascache_lower_bound(mc, time);
+	    i < mc->n && mc->time[i] == time; i++)
+		if (mc->device[i] == device_id &&
+		    mc->glucose[i] == meascache_clamp(glucose))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Follow a row the program itself changed or deleted, which bumped the
+ * database generation by one. A row past last_rowid isn't loaded yet and
+ * is read as it is now by the next sync; one which can't be found means
+ * the columns are off, and they are read again.
+ */
+static int
+meascache_patch(struct meascache *mc, int64_t rowid, int64_t time,
+    unsigned int device_id, int old, int glucose, int delete)
+{
+	ssize_t	 i;
+
+	if (mc->stale)
+		return 0;
+
+	if (rowid <= mc->last_rowid) {
+		if ((i = meascache_find(mc, time, device_id, old)) == -1 ||
+		    meascache_reserve(mc, mc->n) == -1) {
+			meascache_invalidate(mc);
+			return -1;
+		}
+
+		if (delete) {
+			memmove(mc->time + i, mc->time + i + 1,
+			    (mc->n - i - 1) * sizeof(*mc->time));
+			memmove(mc->glucose + i, mc->glucose + i + 1,
+			    (mc->n - i - 1) * sizeof(*mc->glucose));
+			memmove(mc->device + i, mc->device + i + 1,
+			    (mc->n - i - 1) * sizeof(*mc->device));
+			mc->n--;
+		} else
+			mc->glucose[i] = meascache_clamp(glucose);
+
+		mc->dirty = 1;
+	}
+
+	mc->generation++;
+
+	return 0;
+}
+
+int
+meascache_delete(struct meascache *mc, gint64 rowid, gint64 time,
+    unsigned int device_id, int glucose)
+{
+	return meascache_patch(mc, rowid, time, device_id, glucose, 0, 1);
+}
+
+/* The time stays, so the columns stay sorted */
+int
+meascache_update(struct meascache *mc, gint64 rowid, gint64 time,
+    unsigned int device_id, int old, int glucose)
+{
+	return meascache_patch(mc, rowid, time, device_id, old, glucose, 0);
+}
+
+/*
+ * Rows were changed or deleted behind our back, start over on the next
+ * sync. The snapshot can't be trusted either.
+ */
+void
+meascache_invalidate(struct meascache *mc)
+{
+	if (mc->saver != NULL) {
+		g_thread_join(mc->saver);
+		mc->saver = NULL;
+	}
+
+	unlink(mc->path);
+
+	mc->stale = 1;
+	mc->dirty = 1;
+}
+
+/*
+ * Statistics over [from, to) for one device, or GM_DEVICE_ALL.
+ */
+int
+meascache_stats(struct meascache *mc, unsigned int device_id, time_t from,
+    time_t to, struct meas_stats *st)
+{
+	struct meascache_acc	 acc;
+	size_t			 lo, hi;
+	double			 var;
+
+	bzero(st, sizeof(*st));
+	bzero(&acc, sizeof(acc));
+	acc.min = INT16_MAX;
+	acc.max = INT16_MIN;
+
+	lo = meascache_lower_bound(mc, from);
+	hi = meascache_lower_bound(mc, to);
+	if (lo < hi)
+		meascache_select()(mc->glucose + lo, mc->device + lo, hi - lo,
+		    device_id, &acc);
+
+	st->count = acc.count;
+	if (acc.count == 0)
+		return 0;
+
+	st->min = acc.min;
+	st->max = acc.max;
+	st->below = acc.below;
+	st->above = acc.above;
+	st->inrange = acc.count - acc.below - acc.above;
+	st->mean = (double)acc.sum / acc.count;
+	var = (double)acc.sumsq / acc.count - st->mean * st->mean;
+	st->sd = var > 0 ? sqrt(var) : 0;
+
+	return 0;
+}
+
+/*
+ * Check the vector kernels this CPU has against meascache_scalar() on
+ * seeded readings: lengths that aren't a multiple of the vector width,
+ * windows longer than a block, starting off alignment, for all devices
+ * and for one. Returns the number of mismatches, which are printed.
+ */
+int
+meascache_check(guint32 seed)
+{
+	static const size_t	 lens[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 33,
+	    MEASCACHE_BLOCK - 1, MEASCACHE_BLOCK, MEASCACHE_BLOCK + 1,
+	    MEASCACHE_BLOCK + 15, 3 * MEASCACHE_BLOCK + 13 };
+	static const unsigned int devices[] = { GM_DEVICE_ALL, 1, 3 };
+	struct {
+		const char		*name;
+		meascache_kernel	 kernel;
+	}			 kernels[2];
+	struct meascache_acc	 want, got;
+	GRand			*rand;
+	int16_t			*g;
+	uint16_t		*dev;
+	size_t			 i, l, off, n;
+	int			 j, k, nkernels = 0, bad = 0;
+
+#ifdef MEASCACHE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		kernels[nkernels].name = "sse2";
+		kernels[nkernels++].kernel = meascache_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[nkernels].name = "avx2";
+		kernels[nkernels++].kernel = meascache_avx2;
+	}
+#endif
+
+	/* One more, so every window can also start one reading in */
+	n = lens[G_N_ELEMENTS(lens) - 1] + 1;
+	g = calloc(n, sizeof(*g));
+	dev = calloc(n, sizeof(*dev));
+	if (g == NULL || dev == NULL) {
+		free(g);
+		free(dev);
+		return -1;
+	}
+
+	rand = g_rand_new_with_seed(seed);
+	for (i = 0; i < n; i++) {
+		g[i] = g_rand_int_range(rand, 0, MEASCACHE_GLUCOSE_MAX + 1);
+		dev[i] = g_rand_int_range(rand, 1, 5);
+	}
+	g_rand_free(rand);
+
+	for (l = 0; l < G_N_ELEMENTS(lens); l++) {
+		for (off = 0; off <= 1; off++) {
+			for (j = 0; j < (int)G_N_ELEMENTS(devices); j++) {
+				bzero(&want, sizeof(want));
+				want.min = INT16_MAX;
+				want.max = INT16_MIN;
+				meascache_scalar(g + off, dev + off, lens[l],
+				    devices[j], &want);
+
+				for (k = 0; k < nkernels; k++) {
+					bzero(&got, sizeof(got));
+					got.min = INT16_MAX;
+					got.max = INT16_MIN;
+					kernels[k].kernel(g + off, dev + off,
+					    lens[l], devices[j], &got);
+					if (memcmp(&got, &want,
+					    sizeof(got)) == 0)
+						continue;
+
+					fprintf(stderr, "meascache: %s differs "
+					    "from scalar over %zu readings at "
+					    "%zu, device %u\n", kernels[k].name,
+					    lens[l], off, devices[j]);
+					bad++;
+				}
+			}
+		}
+	}
+
+	free(g);
+	free(dev);
+
+	return bad;
+}
+
+/* FNV-1a over 64 bit words, len is a multiple of 8 */
+static uint64_t
+meascache_checksum(const void *data, size_t len)
+{
+	const uint64_t	*p = data;
+	uint64_t	 h = 0xcbf29ce484222325ULL;
+	size_t		 i;
+
+	for (i = 0; i < len / 8; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static size_t
+meascache_image_len(uint64_t count)
+{
+	return sizeof(struct meascache_header) + count * sizeof(int64_t) +
+	    MEASCACHE_PAD(count * sizeof(int16_t)) +
+	    MEASCACHE_PAD(count * sizeof(uint16_t));
+}
+
+/*
+ * Map the snapshot and use it as the columns. It is only used when it
+ * doesn't know about rows the database doesn't have and no rows were
+ * changed or deleted since it was written; rows added after it are
+ * picked up by the next sync.
+ */
+int
+meascache_open(struct meascache *mc, struct gm_db *db)
+{
+	struct meascache_header	*hdr;
+	sqlite3_stmt		*stmt;
+	struct stat		 sb;
+	int64_t			 last_rowid, generation;
+	char			*map;
+	int			 fd;
+
+	stmt = meas_stmt(db, GM_STMT_LAST_ROWID);
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return -1;
+	}
+	last_rowid = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	if ((generation = meascache_generation(db)) == -1)
+		return -1;
+
+	if ((fd = open(mc->path, O_RDONLY)) == -1)
+		return -1;
+
+	if (fstat(fd, &sb) == -1 ||
+	    (size_t)sb.st_size < sizeof(struct meascache_header)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = (struct meascache_header *)map;
+	if (memcmp(hdr->magic, MEASCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != MEASCACHE_VERSION ||
+	    hdr->endian != MEASCACHE_ENDIAN ||
+	    hdr->count > SIZE_MAX / sizeof(int64_t) ||
+	    meascache_image_len(hdr->count) != (size_t)sb.st_size ||
+	    hdr->last_rowid > last_rowid ||
+	    hdr->generation != generation ||
+	    hdr->checksum != meascache_checksum(map + sizeof(*hdr),
+	    sb.st_size - sizeof(*hdr))) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+
+	meascache_release(mc);
+
+	mc->map = map;
+	mc->maplen = sb.st_size;
+	mc->time = (int64_t *)(map + sizeof(*hdr));
+	mc->glucose = (int16_t *)(mc->time + hdr->count);
+	mc->device = (uint16_t *)((char *)mc->glucose +
+	    MEASCACHE_PAD(hdr->count * sizeof(int16_t)));
+	mc->n = mc->size = hdr->count;
+	mc->last_rowid = hdr->last_rowid;
+	mc->generation = hdr->generation;
+	mc->dirty = hdr->last_rowid != last_rowid;
+
+	return 0;
+}
+
+static struct meascache_image *
+meascache_image(struct meascache *mc)
+{
+	struct meascache_image	*im;
+	struct meascache_header	*hdr;
+	char			*p;
+
+	im = g_new0(struct meascache_image, 1);
+	im->len = meascache_image_len(mc->n);
+	if ((im->data = calloc(1, im->len)) == NULL) {
+		g_free(im);
+		return NULL;
+	}
+	im->path = g_strdup(mc->path);
+	im->saving = &mc->saving;
+
+	hdr = (struct meascache_header *)im->data;
+	memcpy(hdr->magic, MEASCACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = MEASCACHE_VERSION;
+	hdr->endian = MEASCACHE_ENDIAN;
+	hdr->count = mc->n;
+	hdr->last_rowid = mc->last_rowid;
+	hdr->generation = mc->generation;
+
+	p = im->data + sizeof(*hdr);
+	memcpy(p, mc->time, mc->n * sizeof(*mc->time));
+	p += mc->n * sizeof(*mc->time);
+	memcpy(p, mc->glucose, mc->n * sizeof(*mc->glucose));
+	p += MEASCACHE_PAD(mc->n * sizeof(*mc->glucose));
+	memcpy(p, mc->device, mc->n * sizeof(*mc->device));
+
+	return im;
+}
+
+/*
+ * Write an image next to the snapshot and move it in place, so a reader
+ * never sees half a file.
+ */
+static int
+meascache_write(struct meascache_image *im)
+{
+	struct meascache_header	*hdr = (struct meascache_header *)im->data;
+	char			*tmp;
+	size_t			 off;
+	ssize_t			 r;
+	int			 fd;
+
+	hdr->checksum = meascache_checksum(im->data + sizeof(*hdr),
+	    im->len - sizeof(*hdr));
+
+	tmp = g_strdup_printf("%s.tmp", im->path);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		goto fail;
+
+	for (off = 0; off < im->len; off += r) {
+		r = write(fd, im->data + off, im->len - off);
+		if (r == -1) {
+			close(fd);
+			goto fail;
+		}
+	}
+
+	if (fsync(fd) == -1 || close(fd) == -1)
+		goto fail;
+
+	if (rename(tmp, im->path) == -1)
+		goto fail;
+
+	g_free(tmp);
+
+	return 0;
+fail:
+	perror(tmp);
+	unlink(tmp);
+	g_free(tmp);
+
+	return -1;
+}
+
+static void
+meascache_image_free(struct meascache_image *im)
+{
+	free(im->data);
+	g_free(im->path);
+	g_free(im);
+}
+
+static gpointer
+meascache_saver(gpointer data)
+{
+	struct meascache_image	*im = data;
+	gint			*saving = im->saving;
+
+	meascache_write(im);
+	meascache_image_free(im);
+
+	g_atomic_int_set(saving, 0);
+
+	return NULL;
+}
+
+/*
+ * Bring the snapshot up to date. In the background this happens at most
+ * once every MEASCACHE_SAVE_INTERVAL seconds; otherwise it is written
+ * before returning.
+ */
+void
+meascache_save(struct meascache *mc, int background)
+{
+	struct meascache_image	*im;
+	gint64			 now;
+
+	if (mc->saver != NULL) {
+		if (background && g_atomic_int_get(&mc->saving))
+			return;
+		g_thread_join(mc->saver);
+		mc->saver = NULL;
+	}
+
+	if (!mc->dirty || mc->stale)
+		return;
+
+	now = g_get_monotonic_time();
+	if (background && mc->saved != 0 &&
+	    now - mc->saved < MEASCACHE_SAVE_INTERVAL * G_USEC_PER_SEC)
+		return;
+
+	if ((im = meascache_image(mc)) == NULL)
+		return;
+
+	mc->dirty = 0;
+	mc->saved = now;
+
+	if (background) {
+		g_atomic_int_set(&mc->saving, 1);
+		mc->saver = g_thread_new("meascache", meascache_saver, im);
+	} else {
+		meascache_write(im);
+		meascache_image_free(im);
+	}
+}
@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A GtkTreeModel on top of the measurements table. Only the number of rows
+ * is kept; rows are fetched a page at a time when the view asks for them.
+ * Pages are located with keyset pagination on the rowid and the most
+ * recently used ones are kept in a small cache.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <time.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+#define MEASMODEL_PAGE_ROWS	256
+#define MEASMODEL_CACHE_PAGES	16
+
+struct measmodel_row {
+	gint64		 rowid;
+	int		 glucose;
+	char		 date[32];
+	const char	*device;	/* interned in measmodel->devices */
+};
+
+struct measmodel_page {
+	int				 index;
+	int				 nrows;
+	struct measmodel_row		 rows[MEASMODEL_PAGE_ROWS];
+	TAILQ_ENTRY(measmodel_page)	 entry;
+};
+
+typedef struct _MeasModel {
+	GObject				 parent;
+
+	struct gm_conf			*conf;
+	gint				 stamp;
+	gint				 nrows;
+	gint64				 last_rowid;
+
+	/*
+	 * keys[p] is the rowid just before the first row of page p, or -1
+	 * when it hasn't been looked up yet.
+	 */
+	gint64				*keys;
+	int				 nkeys;
+
+	TAILQ_HEAD(measmodel_pages, measmodel_page) pages; /* MRU first */
+	int				 npages;
+
+	GHashTable			*devices;
+} MeasModel;
+
+typedef struct _MeasModelClass {
+	GObjectClass			 parent_class;
+} MeasModelClass;
+
+#define MEASMODEL_TYPE		(measmodel_get_type())
+#define MEASMODEL(o)		(G_TYPE_CHECK_INSTANCE_CAST((o), MEASMODEL_TYPE, MeasModel))
+
+static void	measmodel_tree_model_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(MeasModel, measmodel, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, measmodel_tree_model_init))
+
+static void
+measmodel_init(MeasModel *m)
+{
+	m->stamp = g_random_int();
+	TAILQ_INIT(&m->pages);
+	m->devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+measmodel_finalize(GObject *object)
+{
+	MeasModel		*m = MEASMODEL(object);
+	struct measmodel_page	*pg;
+
+	while ((pg = TAILQ_FIRST(&m->pages)) != NULL) {
+		TAILQ_REMOVE(&m->pages, pg, entry);
+		g_free(pg);
+	}
+
+	g_free(m->keys);
+	g_hash_table_destroy(m->devices);
+
+	G_OBJECT_CLASS(measmodel_parent_class)->finalize(object);
+}
+
+static void
+measmodel_class_init(MeasModelClass *klass)
+{
+	G_OBJECT_CLASS(klass)->finalize = measmodel_finalize;
+}
+
+static const char *
+measmodel_intern(MeasModel *m, const unsigned char *device)
+{
+	char	*s;
+
+	if (device == NULL)
+		return "";
+
+	s = g_hash_table_lookup(m->devices, device);
+	if (s == NULL) {
+		s = g_strdup((const char *)device);
+		g_hash_table_insert(m->devices, s, s);
+	}
+
+	return s;
+}
+
+/* Times are the meter's wall clock stored as UTC, see glucosemeter.c */
+static void
+measmodel_date(char *buf, size_t len, time_t time)
+{
+	struct tm	 tm;
+
+	if (gmtime_r(&time, &tm) == NULL ||
+	    strftime(buf, len, "%Y-%m-%d %H:%M", &tm) == 0)
+		buf[0] = '\0';
+}
+
+/* Make room in the key array for the current number of rows */
+static void
+measmodel_grow_keys(MeasModel *m)
+{
+	int	 n;
+
+	n = m->nrows / MEASMODEL_PAGE_ROWS + 1;
+	if (n <= m->nkeys)
+		return;
+
+	m->keys = g_renew(gint64, m->keys, n);
+	for (; m->nkeys < n; m->nkeys++)
+		m->keys[m->nkeys] = m->nkeys == 0 ? 0 : -1;
+}
+
+/* Forget everything we know about pages from page p onwards */
+static void
+measmodel_invalidate(MeasModel *m, int p)
+{
+	struct measmodel_page	*pg, *next;
+	int			 i;
+
+	for (pg = TAILQ_FIRST(&m->pages); pg != NULL; pg = next) {
+		next = TAILQ_NEXT(pg, entry);
+		if (pg->index >= p) {
+			TAILQ_REMOVE(&m->pages, pg, entry);
+			m->npages--;
+			g_free(pg);
+		}
+	}
+
+	for (i = p + 1; i < m->nkeys; i++)
+		m->keys[i] = -1;
+}
+
+/*
+ * Find the key of page p. Walk forward from the nearest page whose key is
+ * known; the result is remembered so this happens once per page.
+ */
+static int
+measmodel_page_key(MeasModel *m, int p, gint64 *key)
+{
+	sqlite3_stmt	*stmt;
+	int		 q, r;
+
+	if (m->keys[p] != -1) {
+		*key = m->keys[p];
+		return 0;
+	}
+
+	for (q = p - 1; m->keys[q] == -1; q--)
+		;
+
+	stmt = meas_stmt(&m->conf->db, GM_STMT_SEEK);
+	if (sqlite3_bind_int64(stmt, 1, m->keys[q]) != SQLITE_OK)
+		return -1;
+	if (sqlite3_bind_int(stmt, 2, (p - q) * MEASMODEL_PAGE_ROWS - 1) != SQLITE_OK)
+		return -1;
+
+	r = sqlite3_step(stmt);
+	if (r != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	m->keys[p] = *key = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return 0;
+}
+
+static struct measmodel_page *
+measmodel_page(MeasModel *m, int p)
+{
+	struct measmodel_page	*pg;
+	struct measmodel_row	*row;
+	sqlite3_stmt		*stmt;
+	gint64			 key;
+	int			 r;
+
+	TAILQ_FOREACH(pg, &m->pages, entry) {
+		if (pg->index == p) {
+			TAILQ_REMOVE(&m->pages, pg, entry);
+			TAILQ_INSERT_HEAD(&m->pages, pg, entry);
+			return pg;
+		}
+	}
+
+	if (measmodel_page_key(m, p, &key) == -1)
+		return NULL;
+
+	if (m->npages < MEASMODEL_CACHE_PAGES) {
+		pg = g_new(struct measmodel_page, 1);
+		m->npages++;
+	} else {
+		pg = TAILQ_LAST(&m->pages, measmodel_pages);
+		TAILQ_REMOVE(&m->pages, pg, entry);
+	}
+	pg->index = p;
+	pg->nrows = 0;
+
+	stmt = meas_stmt(&m->conf->db, GM_STMT_PAGE);
+	sqlite3_bind_int64(stmt, 1, key);
+	sqlite3_bind_int(stmt, 2, MEASMODEL_PAGE_ROWS);
+
+	while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+		row = &pg->rows[pg->nrows++];
+		row->rowid = sqlite3_column_int64(stmt, 0);
+		row->glucose = sqlite3_column_int(stmt, 1);
+		measmodel_date(row->date, sizeof(row->date),
+		    sqlite3_column_int64(stmt, 2));
+		row->device = measmodel_intern(m, sqlite3_column_text(stmt, 3));
+	}
+	sqlite3_reset(stmt);
+
+	TAILQ_INSERT_HEAD(&m->pages, pg, entry);
+
+	if (pg->nrows == MEASMODEL_PAGE_ROWS && p + 1 < m->nkeys)
+		m->keys[p + 1] = pg->rows[pg->nrows - 1].rowid;
+
+	return pg;
+}
+
+static struct measmodel_row *
+measmodel_row(MeasModel *m, int index)
+{
+	struct measmodel_page	*pg;
+	int			 i;
+
+	pg = measmodel_page(m, index / MEASMODEL_PAGE_ROWS);
+	if (pg == NULL)
+		return NULL;
+
+	i = index % MEASMODEL_PAGE_ROWS;
+	if (i >= pg->nrows)
+		return NULL;
+
+	return &pg->rows[i];
+}
+
+static GtkTreeModelFlags
+measmodel_get_flags(GtkTreeModel *tree_model)
+{
+	return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint
+measmodel_get_n_columns(GtkTreeModel *tree_model)
+{
+	return GM_MEAS_NUM_COLS;
+}
+
+static GType
+measmodel_get_column_type(GtkTreeModel *tree_model, gint column)
+{
+	switch (column) {
+	case GM_MEAS_COL_GLUCOSE:
+		return G_TYPE_UINT;
+	case GM_MEAS_COL_ROWID:
+		return G_TYPE_INT64;
+	default:
+		return G_TYPE_STRING;
+	}
+}
+
+static gboolean
+measmodel_iter_nth(MeasModel *m, GtkTreeIter *iter, gint n)
+{
+	if (n < 0 || n >= m->nrows)
+		return FALSE;
+
+	iter->stamp = m->stamp;
+	iter->user_data = GINT_TO_POINTER(n);
+
+	return TRUE;
+}
+
+static gboolean
+measmodel_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter,
+    GtkTreePath *path)
+{
+	if (gtk_tree_path_get_depth(path) != 1)
+		return FALSE;
+
+	return measmodel_iter_nth(MEASMODEL(tree_model), iter,
+	    gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *
+measmodel_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	GtkTreePath	*path;
+
+	path = gtk_tree_path_new();
+	gtk_tree_path_append_index(path, GPOINTER_TO_INT(iter->user_data));
+
+	return path;
+}
+
+static void
+measmodel_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column,
+    GValue *value)
+{
+	MeasModel		*m = MEASMODEL(tree_model);
+	struct measmodel_row	*row;
+
+	g_value_init(value, measmodel_get_column_type(tree_model, column));
+
+	row = measmodel_row(m, GPOINTER_TO_INT(iter->user_data));
+	if (row == NULL)
+		return;
+
+	switch (column) {
+	case GM_MEAS_COL_GLUCOSE:
+		g_value_set_uint(value, row->glucose);
+		break;
+	case GM_MEAS_COL_DATE:
+		g_value_set_string(value, row->date);
+		break;
+	case GM_MEAS_COL_DEVICE:
+		g_value_set_string(value, row->device);
+		break;
+	case GM_MEAS_COL_ROWID:
+		g_value_set_int64(value, row->rowid);
+		break;
+	}
+}
+
+static gboolean
+measmodel_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	return measmodel_iter_nth(MEASMODEL(tree_model), iter,
+	    GPOINTER_TO_INT(iter->user_data) + 1);
+}
+
+static gboolean
+measmodel_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter,
+    GtkTreeIter *parent)
+{
+	if (parent != NULL)
+		return FALSE;
+
+	return measmodel_iter_nth(MEASMODEL(tree_model), iter, 0);
+}
+
+static gboolean
+measmodel_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	return FALSE;
+}
+
+static gint
+measmodel_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	if (iter != NULL)
+		return 0;
+
+	return MEASMODEL(tree_model)->nrows;
+}
+
+static gboolean
+measmodel_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter,
+    GtkTreeIter *parent, gint n)
+{
+	if (parent != NULL)
+		return FALSE;
+
+	return measmodel_iter_nth(MEASMODEL(tree_model), iter, n);
+}
+
+static gboolean
+measmodel_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter,
+    GtkTreeIter *child)
+{
+	return FALSE;
+}
+
+static void
+measmodel_tree_model_init(GtkTreeModelIface *iface)
+{
+	iface->get_flags = measmodel_get_flags;
+	iface->get_n_columns = measmodel_get_n_columns;
+	iface->get_column_type = measmodel_get_column_type;
+	iface->get_iter = measmodel_get_iter;
+	iface->get_path = measmodel_get_path;
+	iface->get_value = measmodel_get_value;
+	iface->iter_next = measmodel_iter_next;
+	iface->iter_children = measmodel_iter_children;
+	iface->iter_has_child = measmodel_iter_has_child;
+	iface->iter_n_children = measmodel_iter_n_children;
+	iface->iter_nth_child = measmodel_iter_nth_child;
+	iface->iter_parent = measmodel_iter_parent;
+}
+
+/*
+ * Count the rows with a rowid above last_rowid. Returns the number of rows
+ * and stores the highest rowid in *max.
+ */
+static int
+measmodel_count(MeasModel *m, gint64 *max)
+{
+	sqlite3_stmt	*stmt;
+	int		 n;
+
+	stmt = meas_stmt(&m->conf->db, GM_STMT_COUNT);
+	if (sqlite3_bind_int64(stmt, 1, m->last_rowid) != SQLITE_OK)
+		return -1;
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	n = sqlite3_column_int(stmt, 0);
+	*max = sqlite3_column_int64(stmt, 1);
+	sqlite3_reset(stmt);
+
+	return n;
+}
+
+GtkTreeModel *
+measmodel_new(struct gm_conf *conf)
+{
+	MeasModel	*m;
+	gint64		 max;
+	int		 n;
+
+	m = g_object_new(MEASMODEL_TYPE, NULL);
+	m->conf = conf;
+
+	n = measmodel_count(m, &max);
+	if (n == -1) {
+		g_object_unref(m);
+		return NULL;
+	}
+
+	m->nrows = n;
+	m->last_rowid = max;
+	measmodel_grow_keys(m);
+
+	return GTK_TREE_MODEL(m);
+}
+
+/*
+ * Pick up rows which were added to the database since the last call. New
+ * rows always sort after the existing ones.
+ */
+int
+measmodel_append(GtkTreeModel *model)
+{
+	MeasModel	*m = MEASMODEL(model);
+	GtkTreeIter	 iter;
+	GtkTreePath	*path;
+	gint64		 max;
+	int		 n, i;
+
+	n = measmodel_count(m, &max);
+	if (n <= 0)
+		return n;
+
+	/* The last page may have been cached while it was partially filled */
+	if (m->nrows > 0)
+		measmodel_invalidate(m, (m->nrows - 1) / MEASMODEL_PAGE_ROWS);
+
+	for (i = 0; i < n; i++) {
+		m->nrows++;
+		m->last_rowid = max;
+		measmodel_grow_keys(m);
+
+		measmodel_iter_nth(m, &iter, m->nrows - 1);
+		path = gtk_tree_path_new();
+		gtk_tree_path_append_index(path, m->nrows - 1);
+		gtk_tree_model_row_inserted(model, path, &iter);
+		gtk_tree_path_free(path);
+	}
+
+	return n;
+}
+
+/*
+ * Return the position of a row in the model, or -1 when it hasn't been
+ * picked up yet. Must be called before the row is deleted.
+ */
+int
+measmodel_index(GtkTreeModel *model, gint64 rowid)
+{
+	MeasModel	*m = MEASMODEL(model);
+	sqlite3_stmt	*stmt;
+	int		 index;
+
+	if (rowid > m->last_rowid)
+		return -1;
+
+	stmt = meas_stmt(&m->conf->db, GM_STMT_INDEX);
+	if (sqlite3_bind_int64(stmt, 1, rowid) != SQLITE_OK)
+		return -1;
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	index = sqlite3_column_int(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return index;
+}
+
+void
+measmodel_row_deleted(GtkTreeModel *model, int index)
+{
+	MeasModel	*m = MEASMODEL(model);
+	sqlite3_stmt	*stmt;
+	GtkTreePath	*path;
+
+	if (index < 0 || index >= m->nrows)
+		return;
+
+	measmodel_invalidate(m, index / MEASMODEL_PAGE_ROWS);
+	m->nrows--;
+	m->stamp++;
+
+	/*
+	 * SQLite hands out max(rowid) + 1 again, however many rows went from
+	 * the end. Rows that weren't picked up yet keep it where it is.
+	 */
+	stmt = meas_stmt(&m->conf->db, GM_STMT_LAST_ROWID);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		m->last_rowid = MIN(m->last_rowid,
+		    sqlite3_column_int64(stmt, 0));
+	sqlite3_reset(stmt);
+
+	path = gtk_tree_path_new();
+	gtk_tree_path_append_index(path, index);
+	gtk_tree_model_row_deleted(model, path);
+	gtk_tree_path_free(path);
+}
+
+void
+measmodel_row_changed(GtkTreeModel *model, int index)
+{
+	MeasModel		*m = MEASMODEL(model);
+	struct measmodel_page	*pg;
+	GtkTreeIter		 iter;
+	GtkTreePath		*path;
+
+	if (!measmodel_iter_nth(m, &iter, index))
+		return;
+
+	TAILQ_FOREACH(pg, &m->pages, entry) {
+		if (pg->index == index / MEASMODEL_PAGE_ROWS) {
+			TAILQ_REMOVE(&m->pages, pg, entry);
+			m->npages--;
+			g_free(pg);
+			break;
+		}
+	}
+
+	path = gtk_tree_path_new();
+	gtk_tree_path_append_index(path, index);
+	gtk_tree_model_row_changed(model, path, &iter);
+	gtk_tree_path_free(path);
+}
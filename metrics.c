@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Counters and latency histograms of the ingest path, written in the
+ * Prometheus text format to whoever connects to the "metrics socket":
+ *
+ *	$ socat -u UNIX-CONNECT:glucosemeter.metrics -
+ *
+ * Every thread counts in a shard of its own, which only it writes to, so
+ * counting is an add to memory no other thread writes. A scrape adds the
+ * shards up and may see a count from a moment ago. The bytes and lines
+ * read are kept with each device the same way, by the thread serving it.
+ * Gauges are looked up when the metrics are written.
+ *
+ * Histograms have four buckets per power of two microseconds, like an HDR
+ * histogram with two significant bits, up to 2^METRICS_MAX_BITS.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+#define METRICS_SUB_BITS	2
+#define METRICS_SUB		(1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS	32	/* 2^32 us, over an hour */
+#define METRICS_BUCKETS		\
+	((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB)
+
+#define METRICS_FAILURES_HELP	\
+	"Downloads given up on a line from the meter, by protocol state"
+#define METRICS_DOWNLOADS_HELP	"Downloads finished, by how they finished"
+
+struct metrics_histogram {
+	guint64			 buckets[METRICS_BUCKETS];
+	guint64			 sum;		/* us */
+	guint64			 count;
+};
+
+struct metrics_shard {
+	guint64			 counters[METRIC_MAX];
+	struct metrics_histogram histograms[METRIC_HISTOGRAM_MAX];
+	SLIST_ENTRY(metrics_shard) entry;
+};
+
+struct metrics {
+	struct gm_conf		*conf;
+	int			 fd;
+	guint			 source;
+};
+
+/* A scrape that didn't fit in the socket buffer at once */
+struct metrics_client {
+	GString			*text;
+	gsize			 off;
+};
+
+/* Series of one family follow each other; keep in the order of enum metric */
+static const struct {
+	const char		*name;
+	const char		*labels;
+	const char		*help;
+} metrics_counters[METRIC_MAX] = {
+	{ "gm_abfr_parse_failures_total", "state=\"send_mem\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"device_type\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"software_revision\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"current_date_time\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"number_of_results\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"result_line\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"end\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_parse_failures_total", "state=\"empty\"",
+	    METRICS_FAILURES_HELP },
+	{ "gm_abfr_checksum_mismatches_total", NULL,
+	    "Downloads whose checksum didn't match" },
+	{ "gm_downloads_total", "status=\"done\"", METRICS_DOWNLOADS_HELP },
+	{ "gm_downloads_total", "status=\"failed\"", METRICS_DOWNLOADS_HELP },
+	{ "gm_downloads_total", "status=\"error\"", METRICS_DOWNLOADS_HELP },
+	{ "gm_downloads_total", "status=\"timeout\"", METRICS_DOWNLOADS_HELP },
+	{ "gm_download_retries_total", NULL,
+	    "Downloads started again after the meter stopped answering" },
+};
+
+static const struct {
+	const char		*name;
+	const char		*help;
+} metrics_histograms[METRIC_HISTOGRAM_MAX] = {
+	{ "gm_download_seconds", "Time from starting a download to done" },
+	{ "gm_insert_batch_seconds",
+	    "Time from queueing a batch for the writer to its commit" },
+	{ "gm_model_fill_seconds", "Time to bring the list up to date" },
+};
+
+static GPrivate metrics_key = G_PRIVATE_INIT(NULL);
+static GMutex metrics_lock;	/* the list of shards */
+static SLIST_HEAD(, metrics_shard) metrics_shards =
+    SLIST_HEAD_INITIALIZER(metrics_shards);
+
+/* Threads keep their shard, what they counted stays in the totals */
+static struct metrics_shard *
+metrics_shard(void)
+{
+	struct metrics_shard	*shard;
+
+	shard = g_private_get(&metrics_key);
+	if (shard != NULL)
+		return shard;
+
+	shard = g_new0(struct metrics_shard, 1);
+	g_private_set(&metrics_key, shard);
+
+	g_mutex_lock(&metrics_lock);
+	SLIST_INSERT_HEAD(&metrics_shards, shard, entry);
+	g_mutex_unlock(&metrics_lock);
+
+	return shard;
+}
+
+void
+metrics_count(enum metric m, guint64 n)
+{
+	metrics_shard()->counters[m] += n;
+}
+
+/* Values in (upper bound of the bucket before, upper bound] */
+static int
+metrics_bucket(guint64 v)
+{
+	int	 e, i;
+
+	if (v > 0)
+		v--;
+	if (v < METRICS_SUB)
+		return v;
+
+	for (e = METRICS_SUB_BITS; e < 63 && (v >> (e + 1)) != 0; e++)
+		;
+
+	i = (e - METRICS_SUB_BITS + 1) * METRICS_SUB +
+	    (int)(v >> (e - METRICS_SUB_BITS)) - METRICS_SUB;
+
+	return MIN(i, METRICS_BUCKETS - 1);
+}
+
+/* In us, the largest value that goes in bucket i */
+static guint64
+metrics_bucket_le(int i)
+{
+	int	 e;
+
+	if (i < METRICS_SUB)
+		return i + 1;
+
+	e = i / METRICS_SUB + METRICS_SUB_BITS - 1;
+
+	return ((guint64)(METRICS_SUB + i % METRICS_SUB + 1)) <<
+	    (e - METRICS_SUB_BITS);
+}
+
+void
+metrics_observe(enum metric_histogram h, gint64 us)
+{
+	struct metrics_histogram *hist = &metrics_shard()->histograms[h];
+
+	if (us < 0)
+		us = 0;
+
+	hist->buckets[metrics_bucket(us)]++;
+	hist->sum += us;
+	hist->count++;
+}
+
+static void
+metrics_family(GString *s, const char *name, const char *help,
+    const char *type)
+{
+	g_string_append_printf(s, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+	    name, type);
+}
+
+/* Device names are paths, which may need escaping in a label */
+static void
+metrics_device(GString *s, const char *name, const char *device,
+    guint64 value)
+{
+	const char	*p;
+
+	g_string_append_printf(s, "%s{device=\"", name);
+	for (p = device; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"')
+			g_string_append_c(s, '\\');
+		if (*p == '\n')
+			g_string_append(s, "\\n");
+		else
+			g_string_append_c(s, *p);
+	}
+	g_string_append_printf(s, "\"} %llu\n", (unsigned long long)value);
+}
+
+static GString *
+metrics_format(struct gm_conf *conf)
+{
+	guint64			 counters[METRIC_MAX];
+	struct metrics_histogram histograms[METRIC_HISTOGRAM_MAX];
+	struct metrics_shard	*shard;
+	struct metrics_histogram *hist;
+	struct devicemgmt_stats	 st;
+	struct dbwriter_stats	 ws;
+	struct device		*dev;
+	const char		*last = NULL;
+	guint64			 cumulative;
+	GString			*s;
+	int			 i, j;
+
+	memset(counters, 0, sizeof(counters));
+	memset(histograms, 0, sizeof(histograms));
+
+	g_mutex_lock(&metrics_lock);
+	SLIST_FOREACH(shard, &metrics_shards, entry) {
+		for (i = 0; i < METRIC_MAX; i++)
+			counters[i] += shard->counters[i];
+		for (i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+			hist = &shard->histograms[i];
+			for (j = 0; j < METRICS_BUCKETS; j++)
+				histograms[i].buckets[j] += hist->buckets[j];
+			histograms[i].sum += hist->sum;
+			histograms[i].count += hist->count;
+		}
+	}
+	g_mutex_unlock(&metrics_lock);
+
+	s = g_string_sized_new(16384);
+
+	for (i = 0; i < METRIC_MAX; i++) {
+		if (last == NULL || strcmp(last, metrics_counters[i].name)) {
+			last = metrics_counters[i].name;
+			metrics_family(s, last, metrics_counters[i].help,
+			    "counter");
+		}
+		if (metrics_counters[i].labels != NULL)
+			g_string_append_printf(s, "%s{%s} %llu\n", last,
+			    metrics_counters[i].labels,
+			    (unsigned long long)counters[i]);
+		else
+			g_string_append_printf(s, "%s %llu\n", last,
+			    (unsigned long long)counters[i]);
+	}
+
+	for (i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+		hist = &histograms[i];
+		last = metrics_histograms[i].name;
+		metrics_family(s, last, metrics_histograms[i].help,
+		    "histogram");
+
+		cumulative = 0;
+		for (j = 0; j < METRICS_BUCKETS; j++) {
+			cumulative += hist->buckets[j];
+			g_string_append_printf(s, "%s_bucket{le=\"%.6f\"} %llu\n",
+			    last, metrics_bucket_le(j) / 1e6,
+			    (unsigned long long)cumulative);
+		}
+		g_string_append_printf(s, "%s_bucket{le=\"+Inf\"} %llu\n"
+		    "%s_sum %.6f\n%s_count %llu\n", last,
+		    (unsigned long long)hist->count, last, hist->sum / 1e6,
+		    last, (unsigned long long)hist->count);
+	}
+
+	/* The devices are only added and removed by this thread */
+	metrics_family(s, "gm_device_read_bytes_total",
+	    "Bytes read from the meter on a port", "counter");
+	TAILQ_FOREACH(dev, &conf->devices, entry) {
+		if (dev->name != NULL)
+			metrics_device(s, "gm_device_read_bytes_total",
+			    dev->name, dev->bytes_read);
+	}
+	metrics_family(s, "gm_device_read_lines_total",
+	    "Lines read from the meter on a port", "counter");
+	TAILQ_FOREACH(dev, &conf->devices, entry) {
+		if (dev->name != NULL)
+			metrics_device(s, "gm_device_read_lines_total",
+			    dev->name, dev->lines_read);
+	}
+
+	devicemgmt_stats(conf, &st);
+	metrics_family(s, "gm_devices_active",
+	    "Devices that haven't finished", "gauge");
+	g_string_append_printf(s, "gm_devices_active %d\n",
+	    devicemgmt_active(conf));
+	metrics_family(s, "gm_downloads_queued",
+	    "Downloads waiting for their turn", "gauge");
+	g_string_append_printf(s, "gm_downloads_queued %d\n", st.queued);
+	metrics_family(s, "gm_downloads_running", "Downloads running",
+	    "gauge");
+	g_string_append_printf(s, "gm_downloads_running %d\n", st.running);
+
+	if (conf->writer != NULL) {
+		dbwriter_stats(conf->writer, &ws);
+		metrics_family(s, "gm_dbwriter_records_total",
+		    "Readings inserted by the writer", "counter");
+		g_string_append_printf(s, "gm_dbwriter_records_total %llu\n",
+		    (unsigned long long)ws.records);
+		metrics_family(s, "gm_dbwriter_commits_total",
+		    "Transactions committed by the writer", "counter");
+		g_string_append_printf(s, "gm_dbwriter_commits_total %llu\n",
+		    (unsigned long long)ws.commits);
+		metrics_family(s, "gm_dbwriter_failures_total",
+		    "Transactions the writer rolled back", "counter");
+		g_string_append_printf(s, "gm_dbwriter_failures_total %llu\n",
+		    (unsigned long long)ws.failures);
+	}
+
+	return s;
+}
+
+/* Returns whether there is more to send */
+static int
+metrics_write(int fd, struct metrics_client *c)
+{
+	ssize_t		 r;
+
+	while (c->off < c->text->len) {
+		r = write(fd, c->text->str + c->off, c->text->len - c->off);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN;
+		}
+		c->off += r;
+	}
+
+	return 0;
+}
+
+static void
+metrics_client_free(struct metrics_client *c)
+{
+	g_string_free(c->text, TRUE);
+	g_free(c);
+}
+
+static gboolean
+metrics_send(GIOChannel *gio, GIOCondition condition, gpointer data)
+{
+	struct metrics_client	*c = data;
+
+	if (!(condition & (G_IO_ERR | G_IO_HUP)) &&
+	    metrics_write(g_io_channel_unix_get_fd(gio), c))
+		return TRUE;
+
+	metrics_client_free(c);
+	g_io_channel_shutdown(gio, FALSE, NULL);
+	g_io_channel_unref(gio);
+
+	return FALSE;
+}
+
+static gboolean
+metrics_accept(GIOChannel *gio, GIOCondition condition, gpointer data)
+{
+	struct metrics		*m = data;
+	struct metrics_client	*c;
+	GIOChannel		*channel;
+	int			 fd;
+
+	fd = accept(m->fd, NULL, NULL);
+	if (fd == -1)
+		return TRUE;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	c = g_new0(struct metrics_client, 1);
+	c->text = metrics_format(m->conf);
+
+	if (!metrics_write(fd, c)) {
+		metrics_client_free(c);
+		close(fd);
+		return TRUE;
+	}
+
+	channel = g_io_channel_unix_new(fd);
+	g_io_add_watch(channel, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+	    metrics_send, c);
+
+	return TRUE;
+}
+
+/* From the main thread, the metrics are written by it */
+int
+metrics_start(struct gm_conf *conf)
+{
+	struct metrics		*m;
+	struct sockaddr_un	 sun;
+	GIOChannel		*channel;
+
+	if (conf->metrics_socket == NULL)
+		return 0;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(conf->metrics_socket) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "metrics: %s: name too long\n",
+		    conf->metrics_socket);
+		return -1;
+	}
+	strncpy(sun.sun_path, conf->metrics_socket, sizeof(sun.sun_path) - 1);
+
+	m = g_new0(struct metrics, 1);
+	m->conf = conf;
+
+	m->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m->fd == -1)
+		goto fail;
+
+	/* Left behind by an earlier run */
+	unlink(conf->metrics_socket);
+
+	if (bind(m->fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(m->fd, 5) == -1)
+		goto fail;
+
+	fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL) | O_NONBLOCK);
+
+	channel = g_io_channel_unix_new(m->fd);
+	m->source = g_io_add_watch(channel, G_IO_IN, metrics_accept, m);
+	g_io_channel_unref(channel);
+
+	conf->metrics = m;
+
+	return 0;
+fail:
+	fprintf(stderr, "metrics: %s: %s\n", conf->metrics_socket,
+	    strerror(errno));
+	if (m->fd != -1)
+		close(m->fd);
+	g_free(m);
+
+	return -1;
+}
+
+void
+metrics_stop(struct gm_conf *conf)
+{
+	struct metrics		*m = conf->metrics;
+
+	if (m == NULL)
+		return;
+
+	g_source_remove(m->source);
+	close(m->fd);
+	unlink(conf->metrics_socket);
+
+	g_free(m);
+	conf->metrics = NULL;
+}
@@ -68,7 +68,8 @@ typedef struct {
 
 %}
 
-%token	GLUCOSEMETER ABFR
+%token	GLUCOSEMETER ABFR COMMIT WINDOW LIMIT INGEST STAGED BATCH
+%token	IO THREADS MATCH RETRY BACKOFF DOWNLOAD HUB METRICS SOCKET TRACE
 %token	ERROR
 %token	<v.string>		STRING
 %token	<v.number>		NUMBER
@@ -83,19 +84,95 @@ grammar		: /* empty */
 
 main		: GLUCOSEMETER ABFR device_file {
 			struct abfr_dev *dev;
-			if ((dev = calloc(1, sizeof(*dev))) == NULL) {
+			if ((dev = abfr_init($3)) == NULL) {
 				perror("calloc");
 				exit(EXIT_FAILURE);
 			}
-			dev->file = strdup($3);
-			dev->device.driver = &abfr_driver;
 			dev->device.conf = conf;
-			dev->device.is_processing = 1;
 
 			TAILQ_INSERT_TAIL(&conf->devices, (struct device *)dev, entry);
 
 			free($3);
 		}
+		| GLUCOSEMETER ABFR MATCH STRING {
+			struct hotplug_pattern *p;
+			if ($4[0] != '/') {
+				yyerror("match pattern must be absolute");
+				free($4);
+				YYERROR;
+			}
+			if ((p = calloc(1, sizeof(*p))) == NULL) {
+				perror("calloc");
+				exit(EXIT_FAILURE);
+			}
+			p->pattern = $4;
+			p->driver = &abfr_driver;
+
+			SLIST_INSERT_HEAD(&conf->patterns, p, entry);
+		}
+		| COMMIT WINDOW NUMBER {
+			if ($3 < 0 || $3 > 60000) {
+				yyerror("commit window out of range");
+				YYERROR;
+			}
+			conf->commit_window = $3;
+		}
+		| COMMIT LIMIT NUMBER {
+			if ($3 < 1 || $3 > INT_MAX) {
+				yyerror("commit limit out of range");
+				YYERROR;
+			}
+			conf->commit_limit = $3;
+		}
+		| INGEST STAGED {
+			conf->ingest_staged = 1;
+		}
+		| INGEST BATCH {
+			conf->ingest_staged = 0;
+		}
+		| IO THREADS NUMBER {
+			if ($3 < 0 || $3 > REACTOR_MAX_THREADS) {
+				yyerror("io threads out of range");
+				YYERROR;
+			}
+			conf->io_threads = $3;
+		}
+		| RETRY LIMIT NUMBER {
+			if ($3 < 0 || $3 > 100) {
+				yyerror("retry limit out of range");
+				YYERROR;
+			}
+			conf->retry_limit = $3;
+		}
+		| RETRY BACKOFF NUMBER {
+			if ($3 < 0 || $3 > DEVICE_RETRY_MAX) {
+				yyerror("retry backoff out of range");
+				YYERROR;
+			}
+			conf->retry_backoff = $3;
+		}
+		| DOWNLOAD LIMIT NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("download limit out of range");
+				YYERROR;
+			}
+			conf->download_limit = $3;
+		}
+		| HUB LIMIT NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("hub limit out of range");
+				YYERROR;
+			}
+			conf->hub_limit = $3;
+		}
+		| METRICS SOCKET STRING {
+			free(conf->metrics_socket);
+			conf->metrics_socket = $3;
+		}
+		| TRACE STRING {
+			free(conf->trace_file);
+			conf->trace_file = $2;
+		}
 		;
 
 device_file	: STRING {
@@ -139,7 +216,23 @@ lookup(char *s)
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
 		{ "abfr",	ABFR},
+		{ "backoff",	BACKOFF},
+		{ "batch",	BATCH},
+		{ "commit",	COMMIT},
+		{ "download",	DOWNLOAD},
 		{ "glucosemeter",	GLUCOSEMETER},
+		{ "hub",	HUB},
+		{ "ingest",	INGEST},
+		{ "io",		IO},
+		{ "limit",	LIMIT},
+		{ "match",	MATCH},
+		{ "metrics",	METRICS},
+		{ "retry",	RETRY},
+		{ "socket",	SOCKET},
+		{ "staged",	STAGED},
+		{ "threads",	THREADS},
+		{ "trace",	TRACE},
+		{ "window",	WINDOW},
 	};
 	const struct keywords	*p;
 
@@ -417,6 +510,17 @@ parse_config(const char *filename, struct gm_conf *xconf)
 
 	conf = xconf;
 
+	conf->commit_window = DBWRITER_COMMIT_WINDOW;
+	conf->commit_limit = DBWRITER_COMMIT_LIMIT;
+	conf->io_threads = REACTOR_THREADS;
+	conf->retry_limit = DEVICE_RETRY_LIMIT;
+	conf->retry_backoff = DEVICE_RETRY_BACKOFF;
+	conf->download_limit = DEVICE_DOWNLOAD_LIMIT;
+	conf->hub_limit = DEVICE_HUB_LIMIT;
+	conf->metrics_socket = NULL;
+	conf->trace_file = NULL;
+	conf->ingest_staged = 0;
+
 	if ((file = pushfile(filename)) == NULL) {
 		return (-1);
 	}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The serial ports are served by reactor threads, each running a main loop
+ * on a GMainContext of its own, so redrawing the window or a slow query in
+ * the main thread doesn't hold up reading from the meters. Devices are
+ * spread over the reactors when they are started.
+ *
+ * Verified downloads go from a reactor straight to the writer's queue. The
+ * few queries a driver makes, like meas_meter_mark(), go through the
+ * reactor's own connection to the database.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sqlite3.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+struct reactor {
+	GMainContext	*context;
+	GThread		*thread;
+	gint		 quit;
+	struct gm_db	 db;
+};
+
+/*
+ * Not a GMainLoop: a g_main_loop_quit() before the thread got to
+ * g_main_loop_run() would be lost.
+ */
+static gpointer
+reactor_main(gpointer data)
+{
+	struct reactor	*r = data;
+
+	g_main_context_push_thread_default(r->context);
+	while (!g_atomic_int_get(&r->quit))
+		g_main_context_iteration(r->context, TRUE);
+	g_main_context_pop_thread_default(r->context);
+
+	return NULL;
+}
+
+struct reactor *
+reactor_start(const char *path, int index)
+{
+	struct reactor	*r;
+	char		 name[16];
+
+	r = g_new0(struct reactor, 1);
+
+	if (sqlite3_open(path, &r->db.handle) != SQLITE_OK)
+		goto fail;
+
+	sqlite3_busy_timeout(r->db.handle, GM_BUSY_TIMEOUT);
+
+	if (meas_db_prepare(&r->db) == -1)
+		goto fail;
+
+	r->context = g_main_context_new();
+
+	snprintf(name, sizeof(name), "reactor%d", index);
+	r->thread = g_thread_new(name, reactor_main, r);
+
+	return r;
+fail:
+	fprintf(stderr, "reactor: %s\n", sqlite3_errmsg(r->db.handle));
+	meas_db_close(&r->db);
+	g_free(r);
+
+	return NULL;
+}
+
+/*
+ * Watch a channel from the reactor's thread, or with r NULL from the main
+ * thread. The source is attached while the loop runs; GLib wakes the
+ * context up to pick it up. The caller gets a reference to the source, so
+ * it can be destroyed from any thread with g_source_destroy().
+ */
+GSource *
+reactor_watch(struct reactor *r, GIOChannel *channel, GIOCondition condition,
+    GIOFunc func, gpointer data)
+{
+	GSource		*source;
+
+	source = g_io_create_watch(channel, condition);
+	g_source_set_callback(source, (GSourceFunc)func, data, NULL);
+	g_source_attach(source, r != NULL ? r->context : NULL);
+
+	return source;
+}
+
+static gboolean
+reactor_timer_dispatch(GSource *source, GSourceFunc func, gpointer data)
+{
+	return func(data);
+}
+
+static GSourceFuncs reactor_timer_funcs = {
+	NULL, NULL, reactor_timer_dispatch, NULL
+};
+
+/*
+ * A timer on the reactor's thread that goes off at the time given to
+ * g_source_set_ready_time(), and not before it is given one. Moving it is
+ * cheaper than making a new timeout each time. The caller gets a reference,
+ * like with reactor_watch().
+ */
+GSource *
+reactor_timer(struct reactor *r, GSourceFunc func, gpointer data)
+{
+	GSource		*source;
+
+	source = g_source_new(&reactor_timer_funcs, sizeof(GSource));
+	g_source_set_callback(source, func, data, NULL);
+	g_source_attach(source, r != NULL ? r->context : NULL);
+
+	return source;
+}
+
+/*
+ * Run func on the reactor's thread, or with r NULL on the main thread,
+ * between the callbacks of its devices. It is always queued, also when
+ * called from that thread, so it never runs inside the caller's callback;
+ * calls run in the order they were made.
+ */
+void
+reactor_invoke(struct reactor *r, GSourceFunc func, gpointer data)
+{
+	GSource		*source;
+
+	source = g_idle_source_new();
+	g_source_set_callback(source, func, data, NULL);
+	g_source_attach(source, r != NULL ? r->context : NULL);
+	g_source_unref(source);
+}
+
+/* The connection to use from the reactor's thread */
+struct gm_db *
+reactor_db(struct reactor *r)
+{
+	return &r->db;
+}
+
+/* Stop the thread, a callback that is running is finished first */
+void
+reactor_stop(struct reactor *r)
+{
+	if (r->thread == NULL)
+		return;
+
+	g_atomic_int_set(&r->quit, 1);
+	g_main_context_wakeup(r->context);
+	g_thread_join(r->thread);
+	r->thread = NULL;
+}
+
+/* Sources still attached go away with the context */
+void
+reactor_free(struct reactor *r)
+{
+	reactor_stop(r);
+
+	g_main_context_unref(r->context);
+	meas_db_close(&r->db);
+	g_free(r);
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tracepoints keep fixed-size binary records of what the devices did in
+ * memory, to be written to the "trace" file when the program exits, gets
+ * SIGUSR1 or crashes. Nothing is formatted until the file is read:
+ *
+ *	$ ./tracedump glucosemeter.trace
+ *
+ * Tracepoints are only compiled in with -DGM_TRACE, see TRACEPOINT().
+ *
+ * Every thread records into a ring of its own, which only it writes to,
+ * so a tracepoint is a clock read and a few stores. The last TRACE_RECORDS
+ * of each thread are kept. Rings are never freed and the list of them is
+ * only pushed onto, so writing them out takes no locks and may be done
+ * from a signal handler. A record written at that moment may come out
+ * torn.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+struct trace_ring {
+	struct trace_record	 records[TRACE_RECORDS];
+	volatile guint		 head;		/* the next record written */
+	guint16			 thread;
+	struct trace_ring	*next;
+};
+
+static GPrivate trace_key = G_PRIVATE_INIT(NULL);
+static struct trace_ring *volatile trace_rings;
+static volatile gint trace_threads;
+static volatile gint trace_devices;
+static char *volatile trace_names[TRACE_DEVICES];
+static const char *trace_path;
+
+static const int trace_fatal_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+};
+
+static struct trace_ring *
+trace_ring(void)
+{
+	struct trace_ring	*ring;
+
+	ring = g_private_get(&trace_key);
+	if (ring != NULL)
+		return ring;
+
+	ring = g_new0(struct trace_ring, 1);
+	ring->thread = g_atomic_int_add(&trace_threads, 1);
+	g_private_set(&trace_key, ring);
+
+	do {
+		ring->next = g_atomic_pointer_get(&trace_rings);
+	} while (!g_atomic_pointer_compare_and_exchange(&trace_rings,
+	    ring->next, ring));
+
+	return ring;
+}
+
+void
+trace_record(enum trace_event ev, struct device *dev, gint64 a, gint64 b)
+{
+	struct trace_ring	*ring = trace_ring();
+	struct trace_record	*rec;
+	guint			 head = ring->head;
+
+	rec = &ring->records[head & (TRACE_RECORDS - 1)];
+	rec->time = g_get_monotonic_time();
+	rec->device = dev != NULL ? dev->trace_id : 0;
+	rec->event = ev;
+	rec->thread = ring->thread;
+	rec->args[0] = a;
+	rec->args[1] = b;
+
+	ring->head = head + 1;
+}
+
+/*
+ * Devices are numbered as they are started, the first TRACE_DEVICES keep
+ * their name in the dump. Names outlive their device, which may be
+ * unplugged before the dump.
+ */
+void
+trace_device(struct device *dev)
+{
+	int	 id;
+
+	if (dev->trace_id != 0)
+		return;
+
+	id = g_atomic_int_add(&trace_devices, 1) + 1;
+	dev->trace_id = id;
+
+	if (id <= TRACE_DEVICES && dev->name != NULL)
+		g_atomic_pointer_set(&trace_names[id - 1], g_strdup(dev->name));
+}
+
+/* Up to the first 8 bytes of a line, as an argument */
+gint64
+trace_text(const char *s, size_t len)
+{
+	gint64	 text = 0;
+
+	memcpy(&text, s, MIN(len, sizeof(text)));
+
+	return text;
+}
+
+static int
+trace_write(int fd, const void *buf, size_t len)
+{
+	const char	*p = buf;
+	ssize_t		 r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/* Only async-signal-safe calls, see trace_fatal() */
+int
+trace_dump(const char *path)
+{
+	struct trace_file_header h;
+	struct trace_file_name	 n;
+	struct trace_file_ring	 fr;
+	struct trace_ring	*rings, *ring;
+	const char		*name;
+	int			 fd, i, saved_errno;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+
+	rings = g_atomic_pointer_get(&trace_rings);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.records = TRACE_RECORDS;
+	h.devices = MIN(g_atomic_int_get(&trace_devices), TRACE_DEVICES);
+	for (ring = rings; ring != NULL; ring = ring->next)
+		h.rings++;
+
+	if (trace_write(fd, &h, sizeof(h)) == -1)
+		goto fail;
+
+	for (i = 0; i < (int)h.devices; i++) {
+		name = g_atomic_pointer_get(&trace_names[i]);
+		n.device = i + 1;
+		n.len = name != NULL ? strlen(name) : 0;
+		if (trace_write(fd, &n, sizeof(n)) == -1 ||
+		    trace_write(fd, name, n.len) == -1)
+			goto fail;
+	}
+
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		fr.thread = ring->thread;
+		fr.head = ring->head;
+		if (trace_write(fd, &fr, sizeof(fr)) == -1 ||
+		    trace_write(fd, ring->records, sizeof(ring->records)) == -1)
+			goto fail;
+	}
+
+	return close(fd);
+
+fail:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return -1;
+}
+
+#ifdef GM_TRACE
+static void
+trace_signal(int sig)
+{
+	int	 saved_errno = errno;
+
+	trace_dump(trace_path);
+	errno = saved_errno;
+}
+
+/* The handler is reset before it runs, the signal kills us this time */
+static void
+trace_fatal(int sig)
+{
+	trace_dump(trace_path);
+	raise(sig);
+}
+#endif
+
+int
+trace_start(struct gm_conf *conf)
+{
+#ifdef GM_TRACE
+	struct sigaction	 sa;
+	size_t			 i;
+
+	if (conf->trace_file == NULL)
+		return 0;
+
+	trace_path = conf->trace_file;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = trace_signal;
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		goto fail;
+
+	sa.sa_handler = trace_fatal;
+	sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (i = 0; i < G_N_ELEMENTS(trace_fatal_signals); i++) {
+		if (sigaction(trace_fatal_signals[i], &sa, NULL) == -1)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	fprintf(stderr, "trace: sigaction: %s\n", strerror(errno));
+
+	return -1;
+#else
+	if (conf->trace_file != NULL)
+		fprintf(stderr, "trace: %s: tracepoints aren't compiled in, "
+		    "build with -DGM_TRACE\n", conf->trace_file);
+
+	return 0;
+#endif
+}
+
+/* The records up to now are written out, tracepoints still record */
+void
+trace_stop(struct gm_conf *conf)
+{
+	size_t		 i;
+
+	if (trace_path == NULL)
+		return;
+
+	signal(SIGUSR1, SIG_DFL);
+	for (i = 0; i < G_N_ELEMENTS(trace_fatal_signals); i++)
+		signal(trace_fatal_signals[i], SIG_DFL);
+
+	if (trace_dump(trace_path) == -1)
+		fprintf(stderr, "trace: %s: %s\n", trace_path,
+		    strerror(errno));
+	trace_path = NULL;
+}
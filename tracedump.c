@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2012 Alexander Schrijver
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Prints the records of a trace written by glucosemeter, see trace.c, in
+ * the order they were recorded by all threads together. Times are seconds
+ * since the first record that is left. One line per record:
+ *
+ *	    0.001234   1 /dev/ttyU0           abfr_line        14 "P 0083 ,"
+ *
+ * Only the first 8 bytes of a line are kept.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/queue.h>
+
+#include <gtk/gtk.h>
+
+#include "glucosemeter.h"
+
+/* Keep in the same order as enum trace_event */
+static const struct {
+	const char	*name;
+	const char	*args;		/* printf format for both arguments */
+} dump_events[TRACE_MAX] = {
+	{ "device_start",	"retries %lld" },
+	{ "device_timeout",	"retries %lld, again in %lld ms" },
+	{ "device_done",	NULL },
+	{ "abfr_not_processing", "" },
+	{ "abfr_read",		"%lld bytes" },
+	{ "abfr_read_error",	"errno %lld" },
+	{ "abfr_line",		NULL },
+	{ "abfr_line_long",	"%lld bytes" },
+	{ "abfr_state",		NULL },
+	{ "abfr_device_type",	"%lld" },
+	{ "abfr_softrev",	"%lld" },
+	{ "abfr_datetime",	"%lld" },
+	{ "abfr_nresults",	"%lld" },
+	{ "abfr_result",	"glucose %lld, time %lld" },
+	{ "abfr_skip",		"time %lld, have %lld" },
+	{ "abfr_checksum",	"ours %lld, the meter's %lld" },
+	{ "abfr_insert_failed",	"" },
+	{ "abfr_sent",		"" },
+	{ "abfr_port_error",	"" },
+};
+
+/* enum abfr_protocol_state */
+static const char *dump_states[] = { "send_mem", "device_type",
+    "software_revision", "current_date_time", "number_of_results",
+    "result_line", "end", "empty", "fail", "done" };
+
+/* enum device_status */
+static const char *dump_status[] = { "done", "failed", "error", "timeout" };
+
+static char	**dump_names;		/* by device, 0 is none */
+static guint32	  dump_ndevices;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: tracedump [-d device] file\n");
+	exit(1);
+}
+
+static void
+dump_read(FILE *f, void *buf, size_t len, const char *path)
+{
+	if (fread(buf, 1, len, f) != len) {
+		if (ferror(f))
+			err(1, "%s", path);
+		errx(1, "%s: truncated", path);
+	}
+}
+
+static int
+dump_cmp(const void *a, const void *b)
+{
+	const struct trace_record *ra = a, *rb = b;
+
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+
+	return (int)ra->thread - (int)rb->thread;
+}
+
+static const char *
+dump_name(const char **names, int n, gint64 i)
+{
+	if (i < 0 || i >= n)
+		return "?";
+
+	return names[i];
+}
+
+static void
+dump_print(const struct trace_record *rec, gint64 start)
+{
+	const char	*device = "-";
+	char		 text[sizeof(rec->args[1])];
+	size_t		 i, len;
+
+	if (rec->device != 0)
+		device = rec->device <= dump_ndevices &&
+		    dump_names[rec->device] != NULL ?
+		    dump_names[rec->device] : "?";
+
+	printf("%12.6f %3u %-20s ", (rec->time - start) / 1e6,
+	    rec->thread, device);
+
+	if (rec->event >= TRACE_MAX) {
+		printf("event %u %lld %lld\n", rec->event,
+		    (long long)rec->args[0], (long long)rec->args[1]);
+		return;
+	}
+
+	printf("%-20s ", dump_events[rec->event].name);
+
+	switch (rec->event) {
+	case TRACE_DEVICE_DONE:
+		printf("%s", dump_name(dump_status,
+		    G_N_ELEMENTS(dump_status), rec->args[0]));
+		break;
+	case TRACE_ABFR_STATE:
+		printf("%s -> %s",
+		    dump_name(dump_states, G_N_ELEMENTS(dump_states),
+		    rec->args[0]),
+		    dump_name(dump_states, G_N_ELEMENTS(dump_states),
+		    rec->args[1]));
+		break;
+	case TRACE_ABFR_LINE:
+		memcpy(text, &rec->args[1], sizeof(text));
+		len = MIN((size_t)rec->args[0], sizeof(text));
+		printf("%lld \"", (long long)rec->args[0]);
+		for (i = 0; i < len; i++) {
+			if (isprint((unsigned char)text[i]) && text[i] != '"' &&
+			    text[i] != '\\')
+				putchar(text[i]);
+			else
+				printf("\\x%02x", (unsigned char)text[i]);
+		}
+		putchar('"');
+		break;
+	default:
+		printf(dump_events[rec->event].args,
+		    (long long)rec->args[0], (long long)rec->args[1]);
+		break;
+	}
+
+	putchar('\n');
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct trace_file_header h;
+	struct trace_file_name	 n;
+	struct trace_file_ring	 fr;
+	struct trace_record	*records, *ring;
+	const char		*path, *device = NULL;
+	guint32			 i, j, count, first, id = 0;
+	size_t			 nrecords = 0, k;
+	FILE			*f;
+	int			 ch;
+
+	while ((ch = getopt(argc, argv, "d:")) != -1) {
+		switch (ch) {
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	path = argv[0];
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	dump_read(f, &h, sizeof(h), path);
+	if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0)
+		errx(1, "%s: not a trace", path);
+	if (h.records == 0 || (h.records & (h.records - 1)) != 0)
+		errx(1, "%s: %u records per ring", path, h.records);
+
+	dump_ndevices = h.devices;
+	if ((dump_names = calloc(h.devices + 1, sizeof(*dump_names))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < h.devices; i++) {
+		dump_read(f, &n, sizeof(n), path);
+		if (n.device == 0 || n.device > h.devices)
+			errx(1, "%s: device %u", path, n.device);
+		if ((dump_names[n.device] = calloc(1, n.len + 1)) == NULL)
+			err(1, "calloc");
+		dump_read(f, dump_names[n.device], n.len, path);
+		if (device != NULL && strcmp(device, dump_names[n.device]) == 0)
+			id = n.device;
+	}
+	if (device != NULL && id == 0)
+		errx(1, "%s: no device %s", path, device);
+
+	if ((ring = calloc(h.records, sizeof(*ring))) == NULL ||
+	    (records = calloc((size_t)h.rings * h.records,
+	    sizeof(*records))) == NULL)
+		err(1, "calloc");
+
+	/* Oldest first; slots never written have no time */
+	for (i = 0; i < h.rings; i++) {
+		dump_read(f, &fr, sizeof(fr), path);
+		dump_read(f, ring, h.records * sizeof(*ring), path);
+
+		count = MIN(fr.head, h.records);
+		first = fr.head - count;
+		for (j = 0; j < count; j++) {
+			records[nrecords] = ring[(first + j) & (h.records - 1)];
+			if (records[nrecords].time == 0)
+				continue;
+			if (device != NULL && records[nrecords].device != id)
+				continue;
+			nrecords++;
+		}
+	}
+	fclose(f);
+
+	qsort(records, nrecords, sizeof(*records), dump_cmp);
+
+	for (k = 0; k < nrecords; k++)
+		dump_print(&records[k], records[0].time);
+
+	return 0;
+}